@@ -0,0 +1,88 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+void arena_init(arena_t *arena)
+{
+    if(!arena) {
+        fprintf(stderr, "arena_init: Failed to access arena\n");
+        return;
+    }
+    arena->head = NULL;
+}
+
+static arena_block_t *arena_new_block(const arena_block_t *prev, size_t min_size)
+{
+    // Small arenas stay small; busy ones grow towards ARENA_BLOCK_SIZE
+    size_t capacity = prev ? prev->capacity * 2 : ARENA_MIN_BLOCK_SIZE;
+    if(capacity > ARENA_BLOCK_SIZE) capacity = ARENA_BLOCK_SIZE;
+
+    // Oversized requests get a dedicated block so the regular blocks stay dense
+    if(min_size > capacity) capacity = min_size;
+
+    arena_block_t *block = malloc(sizeof(arena_block_t) + capacity);
+    if(!block) return NULL;
+
+    block->next = NULL;
+    block->used = 0;
+    block->capacity = capacity;
+    return block;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    if(!arena) {
+        fprintf(stderr, "arena_alloc: Failed to access arena\n");
+        return NULL;
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_block_t *block = arena->head;
+    if(!block || block->capacity - block->used < size) {
+        arena_block_t *new_block = arena_new_block(block, size);
+        if(!new_block) {
+            fprintf(stderr, "arena_alloc: Failed to allocate arena block\n");
+            return NULL;
+        }
+
+        if(block && size > ARENA_BLOCK_SIZE) {
+            // Keep bump-allocating from the current block after a one-off large allocation
+            new_block->next = block->next;
+            block->next = new_block;
+        } else {
+            new_block->next = block;
+            arena->head = new_block;
+        }
+        block = new_block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    char *copy = arena_alloc(arena, len);
+    if(!copy) return NULL;
+
+    memcpy(copy, str, len);
+    return copy;
+}
+
+void arena_free(arena_t *arena)
+{
+    if(!arena) return;
+
+    arena_block_t *block = arena->head;
+    while(block) {
+        arena_block_t *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
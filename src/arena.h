@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Region allocator: allocations are bump-allocated out of large blocks and
+// released together by arena_free. Individual allocations are never freed.
+#define ARENA_MIN_BLOCK_SIZE (64 << 10)  // First block is 64KB...
+#define ARENA_BLOCK_SIZE (1 << 20)       // ...doubling up to 1MB blocks
+#define ARENA_ALIGN 8
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} arena_block_t;
+
+typedef struct {
+    arena_block_t *head;
+} arena_t;
+
+void arena_init(arena_t *arena);
+
+// Returns ARENA_ALIGN-aligned memory valid until arena_free, or NULL on failure
+void *arena_alloc(arena_t *arena, size_t size);
+
+// Copy a NUL-terminated string into the arena
+char *arena_strdup(arena_t *arena, const char *str);
+
+// Release every block owned by the arena and reset it for reuse
+void arena_free(arena_t *arena);
+
+#endif
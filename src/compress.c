@@ -0,0 +1,312 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <omp.h>
+
+#ifdef USBDIFF_ZLIB
+#include <zlib.h>
+
+typedef struct {
+    unsigned char *in;
+    size_t len;
+    unsigned char *out;
+    size_t out_len;
+    int status;
+} chunk_t;
+
+// Compress in as one complete gzip member
+static int gzip_chunk(const unsigned char *in, size_t len, unsigned char *out, size_t capacity, size_t *out_len, int level)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)len;
+    zs.next_out = out;
+    zs.avail_out = (uInt)capacity;
+
+    int ret = deflate(&zs, Z_FINISH);
+    *out_len = capacity - zs.avail_out;
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+// Compress the start of a file at the fastest level and require a 10% saving
+static int worth_compressing(const unsigned char *buf, size_t len, unsigned char *scratch, size_t capacity)
+{
+    size_t sample = len < COMPRESS_SAMPLE_SIZE ? len : COMPRESS_SAMPLE_SIZE;
+    size_t out_len;
+
+    if (gzip_chunk(buf, sample, scratch, capacity, &out_len, 1) != 0) return 0;
+    return out_len < sample - sample / 10;
+}
+
+// Fill up to nchunks chunks, stopping at the end of the file
+static int read_round(FILE *in, chunk_t *chunks, int nchunks)
+{
+    int n = 0;
+    while (n < nchunks) {
+        chunks[n].len = fread(chunks[n].in, 1, COMPRESS_CHUNK_SIZE, in);
+        if (chunks[n].len == 0) break;
+        if (chunks[n++].len < COMPRESS_CHUNK_SIZE) break;
+    }
+    return n;
+}
+
+int compress_file(const char *src, const char *dst, int level, copystats_t *stats)
+{
+    char tmp[PATH_MAX], final[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, dst) >= (int)sizeof(tmp)) return -1;
+    if (snprintf(final, sizeof(final), "%s" COMPRESS_SUFFIX, dst) >= (int)sizeof(final)) return -1;
+
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open source file: %s\n", src);
+        return -1;
+    }
+
+    // One chunk per thread and round, sharing the cores with the other copies of the pool
+    int nchunks = omp_get_num_procs() / omp_get_num_threads();
+    if (nchunks < 1) nchunks = 1;
+    size_t capacity = compressBound(COMPRESS_CHUNK_SIZE) + 32;
+    chunk_t *chunks = calloc((size_t)nchunks, sizeof(chunk_t));
+    unsigned char *buf = malloc((size_t)nchunks * (COMPRESS_CHUNK_SIZE + capacity));
+    if (!chunks || !buf) {
+        fprintf(stderr, "compress_file: Failed to allocate compression buffers\n");
+        free(chunks);
+        free(buf);
+        fclose(in);
+        return -1;
+    }
+
+    for (int i = 0; i < nchunks; i++) {
+        chunks[i].in = buf + (size_t)i * (COMPRESS_CHUNK_SIZE + capacity);
+        chunks[i].out = chunks[i].in + COMPRESS_CHUNK_SIZE;
+    }
+
+    int n = read_round(in, chunks, nchunks);
+    if (n == 0 || chunks[0].len < COMPRESS_MIN_SIZE || !worth_compressing(chunks[0].in, chunks[0].len, chunks[0].out, capacity)) {
+        free(chunks);
+        free(buf);
+        fclose(in);
+        return COMPRESS_STORED;
+    }
+
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fprintf(stderr, "compress_file: Failed to create destination file: %s\n", tmp);
+        free(chunks);
+        free(buf);
+        fclose(in);
+        return -1;
+    }
+
+    long long read_bytes = 0, written = 0;
+    int status = 0;
+    while (n > 0 && status == 0) {
+        #pragma omp parallel for schedule(static, 1) num_threads(n) if(n > 1)
+        for (int i = 0; i < n; i++) {
+            chunks[i].status = gzip_chunk(chunks[i].in, chunks[i].len, chunks[i].out, capacity, &chunks[i].out_len, level);
+        }
+
+        for (int i = 0; i < n && status == 0; i++) {
+            if (chunks[i].status != 0 || fwrite(chunks[i].out, 1, chunks[i].out_len, out) != chunks[i].out_len) {
+                fprintf(stderr, "compress_file: Failed to write to destination file: %s\n", tmp);
+                status = -1;
+            }
+            read_bytes += chunks[i].len;
+            written += chunks[i].out_len;
+        }
+
+        if (status == 0) n = read_round(in, chunks, nchunks);
+    }
+    if (ferror(in)) status = -1;
+
+    if (status == 0 && fflush(out) == 0) copy_metadata(fileno(in), fileno(out));
+
+    free(chunks);
+    free(buf);
+    fclose(in);
+    if (fclose(out) != 0) status = -1;
+
+#ifdef _WIN32
+    if (status == 0) remove(final);
+#endif
+    if (status != 0 || rename(tmp, final) != 0) {
+        fprintf(stderr, "compress_file: Failed to compress %s to %s\n", src, final);
+        remove(tmp);
+        return -1;
+    }
+
+    // Drop an earlier uncompressed copy
+    remove(dst);
+
+    if (stats) {
+        stats->files++;
+        stats->bytes_compressed += read_bytes;
+        stats->bytes_stored += written;
+    }
+    return 0;
+}
+
+#else
+
+int compress_file(const char *src, const char *dst, int level, copystats_t *stats)
+{
+    (void)src;
+    (void)dst;
+    (void)level;
+    (void)stats;
+    return COMPRESS_STORED;
+}
+
+#endif
+
+static void complist_path(char *out, size_t size, const char *dst_root)
+{
+    snprintf(out, size, "%s/" COMPRESS_LIST, dst_root);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Index of the first path not less than path
+static size_t complist_lower_bound(const complist_t *list, const char *path)
+{
+    size_t lo = 0, hi = list->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(list->paths[mid], path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int complist_load(complist_t *list, const char *dst_root)
+{
+    memset(list, 0, sizeof(*list));
+
+    char path[PATH_MAX];
+    complist_path(path, sizeof(path), dst_root);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    char line[PATH_MAX + 2];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0') continue;
+
+        if (list->len == list->capacity) {
+            size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+            char **paths = realloc(list->paths, new_capacity * sizeof(char *));
+            if (!paths) break;
+            list->paths = paths;
+            list->capacity = new_capacity;
+        }
+        if (!(list->paths[list->len] = strdup(line))) break;
+        list->len++;
+    }
+
+    int status = ferror(fp) || !feof(fp) ? -1 : 0;
+    fclose(fp);
+    if (status != 0) fprintf(stderr, "complist_load: Failed to read %s\n", path);
+
+    qsort(list->paths, list->len, sizeof(char *), compare_paths);
+    return status;
+}
+
+int complist_contains(const complist_t *list, const char *path)
+{
+    size_t i = complist_lower_bound(list, path);
+    return i < list->len && strcmp(list->paths[i], path) == 0;
+}
+
+int complist_add(complist_t *list, const char *path)
+{
+    size_t i = complist_lower_bound(list, path);
+    if (i < list->len && strcmp(list->paths[i], path) == 0) return 0;
+
+    if (list->len == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        char **paths = realloc(list->paths, new_capacity * sizeof(char *));
+        if (!paths) return -1;
+        list->paths = paths;
+        list->capacity = new_capacity;
+    }
+
+    char *copy = strdup(path);
+    if (!copy) return -1;
+
+    memmove(&list->paths[i + 1], &list->paths[i], (list->len - i) * sizeof(char *));
+    list->paths[i] = copy;
+    list->len++;
+    list->changed = 1;
+    return 0;
+}
+
+void complist_remove(complist_t *list, const char *path)
+{
+    size_t i = complist_lower_bound(list, path);
+    if (i == list->len || strcmp(list->paths[i], path) != 0) return;
+
+    free(list->paths[i]);
+    memmove(&list->paths[i], &list->paths[i + 1], (list->len - i - 1) * sizeof(char *));
+    list->len--;
+    list->changed = 1;
+}
+
+int complist_save(complist_t *list, const char *dst_root)
+{
+    if (!list->changed) return 0;
+
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    complist_path(path, sizeof(path), dst_root);
+    snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, path);
+
+    // An empty list is no list
+    if (list->len == 0) {
+        if (remove(path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "complist_save: Failed to remove %s\n", path);
+            return -1;
+        }
+        list->changed = 0;
+        return 0;
+    }
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        fprintf(stderr, "complist_save: Failed to open %s\n", tmp);
+        return -1;
+    }
+
+    int ok = 1;
+    for (size_t i = 0; ok && i < list->len; i++) {
+        ok = fprintf(fp, "%s\n", list->paths[i]) >= 0;
+    }
+    if (fclose(fp) != 0) ok = 0;
+
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "complist_save: Failed to write %s\n", path);
+        remove(tmp);
+        return -1;
+    }
+
+    list->changed = 0;
+    return 0;
+}
+
+void complist_free(complist_t *list)
+{
+    for (size_t i = 0; i < list->len; i++) free(list->paths[i]);
+    free(list->paths);
+    memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,54 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "copy.h"
+
+// --compress: copies are gzip compressed on the way to the destination, trading idle CPU for
+// USB bandwidth. A compressed copy is stored as dst COMPRESS_SUFFIX and can be restored with
+// gunzip. Large files are cut into COMPRESS_CHUNK_SIZE pieces that are compressed in parallel
+// and written as consecutive gzip members, which gunzip reads back as one stream.
+// Only built with make ZLIB=1.
+#ifdef USBDIFF_ZLIB
+#define COMPRESS_SUPPORTED 1
+#else
+#define COMPRESS_SUPPORTED 0
+#endif
+
+#define COMPRESS_SUFFIX ".gz"
+#define COMPRESS_CHUNK_SIZE (1 << 20)
+#define COMPRESS_SAMPLE_SIZE (64 << 10)    // Compressed at the start of a file to decide whether it is worth it
+#define COMPRESS_MIN_SIZE 4096              // Smaller files fill a cluster of the stick either way
+#define COMPRESS_STORED 1
+#define COMPRESS_LIST ".usbdiff.compressed"  // Kept at the root of the destination it describes
+
+// Compress src into dst COMPRESS_SUFFIX at the given zlib level (1-9), through a temporary
+// file named like the one copy_files uses for dst. Returns COMPRESS_STORED without writing
+// anything if src is too small or its first COMPRESS_SAMPLE_SIZE bytes barely compress, as
+// with media and archives; the caller then copies it as is. The parent of dst must exist.
+int compress_file(const char *src, const char *dst, int level, copystats_t *stats);
+
+// Files of a destination, relative to its root, whose copy may be stored compressed. A
+// name ending in COMPRESS_SUFFIX says nothing on its own: it may just as well be the backup
+// of a source file of that name, so only the files listed here ever have their compressed
+// form moved or removed. Built without zlib too, as the destination may have been written
+// by a build with it.
+typedef struct {
+    char **paths;           // Sorted
+    size_t len;
+    size_t capacity;
+    int changed;            // Differs from what was loaded
+} complist_t;
+
+// Load the list saved at the root of a destination. A missing file leaves it empty.
+int complist_load(complist_t *list, const char *dst_root);
+
+int complist_contains(const complist_t *list, const char *path);
+int complist_add(complist_t *list, const char *path);
+void complist_remove(complist_t *list, const char *path);
+
+// Write the list back if it changed
+int complist_save(complist_t *list, const char *dst_root);
+
+void complist_free(complist_t *list);
+
+#endif
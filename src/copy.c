@@ -0,0 +1,789 @@
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range
+#endif
+
+#include "copy.h"
+#include "sha-256.h"
+#include "delta.h"
+#include "compress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#endif
+
+// Largest single request handed to copy_file_range or sendfile
+#define COPY_CHUNK_SIZE (1 << 30)
+
+void ensure_directory_exists(const char *path)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/' || *p == '\\') {
+            char c = *p;
+            *p = '\0';
+
+#ifdef _WIN32
+            _mkdir(tmp); // Windows
+#else
+            mkdir(tmp, 0755); // POSIX
+#endif
+            *p = c;
+        }
+    }
+
+#ifdef _WIN32
+    _mkdir(tmp);
+#else
+    mkdir(tmp, 0755);
+#endif
+}
+
+void ensure_parent_exists(const char *dst)
+{
+    char dst_parent[PATH_MAX];
+    snprintf(dst_parent, sizeof(dst_parent), "%s", dst);
+
+    char *last_sep = strrchr(dst_parent, '/');
+#ifdef _WIN32
+    char *last_backslash = strrchr(dst_parent, '\\');
+    if (last_backslash && (!last_sep || last_backslash > last_sep)) {
+        last_sep = last_backslash;
+    }
+#endif
+
+    if (last_sep) {
+        *last_sep = '\0';
+        ensure_directory_exists(dst_parent);
+    }
+}
+
+#define DIRCACHE_MIN_SLOTS 1024
+
+static int is_separator(char c)
+{
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+void dircache_init(dircache_t *cache, const char *root)
+{
+    cache->root = root;
+    cache->root_len = strlen(root);
+    while (cache->root_len > 1 && is_separator(root[cache->root_len - 1])) cache->root_len--;
+
+    cache->root_fd = -1;
+    cache->slots = NULL;
+    cache->nslots = 0;
+    cache->len = 0;
+    arena_init(&cache->arena);
+    omp_init_lock(&cache->lock);
+}
+
+static size_t dircache_hash(const char *dir, size_t len)
+{
+    size_t hash = 5381;
+    for (size_t i = 0; i < len; i++) hash = hash * 33 + (unsigned char)dir[i];
+    return hash;
+}
+
+static char **dircache_slot(char **slots, size_t nslots, const char *dir, size_t len)
+{
+    size_t i = dircache_hash(dir, len) & (nslots - 1);
+    while (slots[i] && (strncmp(slots[i], dir, len) != 0 || slots[i][len] != '\0')) {
+        i = (i + 1) & (nslots - 1);
+    }
+    return &slots[i];
+}
+
+static int dircache_contains(const dircache_t *cache, const char *dir, size_t len)
+{
+    return cache->nslots && *dircache_slot(cache->slots, cache->nslots, dir, len) != NULL;
+}
+
+static int dircache_insert(dircache_t *cache, const char *dir, size_t len)
+{
+    // Keep the table at most half full
+    if ((cache->len + 1) * 2 > cache->nslots) {
+        size_t nslots = cache->nslots ? cache->nslots * 2 : DIRCACHE_MIN_SLOTS;
+        char **slots = calloc(nslots, sizeof(char *));
+        if (!slots) return -1;
+
+        for (size_t i = 0; i < cache->nslots; i++) {
+            char *entry = cache->slots[i];
+            if (entry) *dircache_slot(slots, nslots, entry, strlen(entry)) = entry;
+        }
+        free(cache->slots);
+        cache->slots = slots;
+        cache->nslots = nslots;
+    }
+
+    char **slot = dircache_slot(cache->slots, cache->nslots, dir, len);
+    if (*slot) return 0;
+
+    char *entry = arena_alloc(&cache->arena, len + 1);
+    if (!entry) return -1;
+    memcpy(entry, dir, len);
+    entry[len] = '\0';
+
+    *slot = entry;
+    cache->len++;
+    return 0;
+}
+
+// Create the destination root itself, once
+static int dircache_open_root(dircache_t *cache)
+{
+    if (cache->root_fd >= 0) return 0;
+
+    char root[PATH_MAX];
+    snprintf(root, sizeof(root), "%.*s", (int)cache->root_len, cache->root);
+    ensure_directory_exists(root);
+
+#ifdef _WIN32
+    cache->root_fd = 0; // Only marks the root as created; _mkdir takes full paths
+#else
+    cache->root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (cache->root_fd < 0) {
+        fprintf(stderr, "dircache: Failed to open destination %s\n", root);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static int dircache_mkdir(const dircache_t *cache, const char *dir)
+{
+#ifdef _WIN32
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%.*s\\%s", (int)cache->root_len, cache->root, dir);
+    return _mkdir(full) == 0 || errno == EEXIST ? 0 : -1;
+#else
+    return mkdirat(cache->root_fd, dir, 0755) == 0 || errno == EEXIST ? 0 : -1;
+#endif
+}
+
+// Path relative to the root, or NULL if path is outside it
+static const char *dircache_relative(const dircache_t *cache, const char *path)
+{
+    if (!cache || strncmp(path, cache->root, cache->root_len) != 0 || !is_separator(path[cache->root_len])) return NULL;
+
+    const char *rel = path + cache->root_len;
+    while (is_separator(*rel)) rel++;
+    return rel;
+}
+
+int dircache_ensure_parent(dircache_t *cache, const char *path)
+{
+    const char *rel = dircache_relative(cache, path);
+    if (!rel) {
+        ensure_parent_exists(path);
+        return 0;
+    }
+
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", rel);
+
+    size_t len = 0;
+    for (size_t i = 0; dir[i]; i++) {
+        if (is_separator(dir[i])) len = i;
+    }
+
+    omp_set_lock(&cache->lock);
+
+    int status = dircache_open_root(cache);
+    if (status == 0 && len > 0 && !dircache_contains(cache, dir, len)) {
+        // Walk up to the deepest directory already known to exist...
+        size_t known = len;
+        while (known > 0 && !dircache_contains(cache, dir, known)) {
+            do known--; while (known > 0 && !is_separator(dir[known]));
+        }
+
+        // ...then create everything below it, parents first
+        for (size_t end = known ? known + 1 : 0; status == 0 && end <= len; end++) {
+            if (end < len && !is_separator(dir[end])) continue;
+
+            char c = dir[end];
+            dir[end] = '\0';
+            status = dircache_mkdir(cache, dir);
+            if (status == 0) status = dircache_insert(cache, dir, end);
+            dir[end] = c;
+        }
+    }
+
+    omp_unset_lock(&cache->lock);
+    return status;
+}
+
+// Length of the directory part of a relative path, 0 for the root
+static size_t parent_length(const char *rel)
+{
+    size_t len = 0;
+    for (size_t i = 0; rel[i]; i++) {
+        if (is_separator(rel[i])) len = i;
+    }
+    return len;
+}
+
+static int compare_relative(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+#ifndef _WIN32
+static int dircache_unlink_in(int dir_fd, const char *rel)
+{
+    const char *name = rel + parent_length(rel);
+    while (is_separator(*name)) name++;
+    return unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT ? 0 : -1;
+}
+#endif
+
+static int dircache_rmdir(const dircache_t *cache, const char *dir)
+{
+#ifdef _WIN32
+    char full[PATH_MAX];
+    snprintf(full, sizeof(full), "%.*s\\%s", (int)cache->root_len, cache->root, dir);
+    return _rmdir(full);
+#else
+    return unlinkat(cache->root_fd, dir, AT_REMOVEDIR);
+#endif
+}
+
+size_t dircache_remove(dircache_t *cache, const char *const *paths, size_t count, int *status)
+{
+    const char **rels = malloc((count ? count : 1) * sizeof(const char *));
+    if (!rels) {
+        fprintf(stderr, "dircache_remove: Failed to allocate removal batch\n");
+        for (size_t i = 0; i < count; i++) status[i] = -1;
+        return count;
+    }
+
+    // Paths outside the root are removed directly
+    size_t nrels = 0, failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *rel = dircache_relative(cache, paths[i]);
+        if (rel && *rel) {
+            rels[nrels++] = rel;
+            status[i] = 0;
+        } else {
+            status[i] = remove(paths[i]) == 0 || errno == ENOENT ? 0 : -1;
+        }
+    }
+
+    // Sorted, the files of a directory are adjacent and children follow their parents
+    qsort(rels, nrels, sizeof(const char *), compare_relative);
+
+    omp_set_lock(&cache->lock);
+    int ok = dircache_open_root(cache) == 0;
+
+    for (size_t start = 0, end; ok && start < nrels; start = end) {
+        size_t dir_len = parent_length(rels[start]);
+        for (end = start + 1; end < nrels; end++) {
+            if (parent_length(rels[end]) != dir_len || strncmp(rels[end], rels[start], dir_len) != 0) break;
+        }
+
+#ifdef _WIN32
+        for (size_t i = start; i < end; i++) {
+            char full[PATH_MAX];
+            snprintf(full, sizeof(full), "%.*s\\%s", (int)cache->root_len, cache->root, rels[i]);
+            if (remove(full) != 0 && errno != ENOENT) {
+                fprintf(stderr, "dircache_remove: Failed to remove %s\n", full);
+                failed++;
+            }
+        }
+#else
+        // One descriptor for every file of the directory
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", (int)dir_len, rels[start]);
+        int dir_fd = dir_len ? openat(cache->root_fd, dir, O_RDONLY | O_DIRECTORY) : cache->root_fd;
+        if (dir_fd < 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "dircache_remove: Failed to open %s\n", dir);
+                failed += end - start;
+            }
+            continue;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            if (dircache_unlink_in(dir_fd, rels[i]) != 0) {
+                fprintf(stderr, "dircache_remove: Failed to remove %s\n", rels[i]);
+                failed++;
+            }
+        }
+        if (dir_fd != cache->root_fd) close(dir_fd);
+#endif
+    }
+
+    // Prune directories left empty, deepest first. Each walk goes up until a directory
+    // that still holds something, and the last walk through a shared parent comes after
+    // all of its children have been tried.
+    int pruned = 0;
+    for (size_t i = nrels; ok && i-- > 0; ) {
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", rels[i]);
+
+        for (size_t len = parent_length(dir); len > 0; len = parent_length(dir)) {
+            dir[len] = '\0';
+            if (dircache_rmdir(cache, dir) != 0) break;
+            pruned = 1;
+        }
+    }
+
+    // Forget every created directory, some of them are gone now
+    if (pruned) {
+        free(cache->slots);
+        cache->slots = NULL;
+        cache->nslots = 0;
+        cache->len = 0;
+    }
+
+    omp_unset_lock(&cache->lock);
+
+    // Failures were counted per directory batch; find which of the caller's paths they were
+    if (failed || !ok) {
+        for (size_t i = 0; i < count; i++) {
+            const char *rel = dircache_relative(cache, paths[i]);
+            struct stat st;
+            if (rel && *rel && (!ok || stat(paths[i], &st) == 0)) status[i] = -1;
+        }
+    }
+    free(rels);
+
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) total += status[i] != 0;
+    return total;
+}
+
+void dircache_free(dircache_t *cache)
+{
+#ifndef _WIN32
+    if (cache->root_fd >= 0) close(cache->root_fd);
+#endif
+    cache->root_fd = -1;
+    free(cache->slots);
+    cache->slots = NULL;
+    arena_free(&cache->arena);
+    omp_destroy_lock(&cache->lock);
+}
+
+#ifndef _WIN32
+// Errors that mean "this kernel or filesystem pair can't do it", as opposed to a real I/O error
+static int copy_unsupported(int err)
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == EPERM;
+}
+
+// Share in's extents with the empty file out
+static int clone_data(int in, int out)
+{
+#if defined(__linux__) && defined(FICLONE)
+    return ioctl(out, FICLONE, in);
+#else
+    (void)in;
+    (void)out;
+    return -1;
+#endif
+}
+
+// Copy up to len bytes, or to the end of in, from the current offset of in to the current
+// offset of out, adding the bytes moved to *copied. Each method advances both offsets, so a
+// fallback carries on where the previous one stopped.
+static int copy_data(int in, int out, long long len, long long *copied)
+{
+#ifdef __linux__
+    ssize_t n = 0;
+    int started = 0;
+
+    while (len > 0 && (n = copy_file_range(in, NULL, out, NULL, len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE, 0)) > 0) {
+        *copied += n;
+        len -= n;
+        started = 1;
+    }
+    if (len == 0 || n == 0) return 0;
+    if (started || !copy_unsupported(errno)) return -1;
+
+    while (len > 0 && (n = sendfile(out, in, NULL, len < COPY_CHUNK_SIZE ? len : COPY_CHUNK_SIZE)) > 0) {
+        *copied += n;
+        len -= n;
+        started = 1;
+    }
+    if (len == 0 || n == 0) return 0;
+    if (started || !copy_unsupported(errno)) return -1;
+#endif
+
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "copy_file: Failed to allocate copy buffer\n");
+        return -1;
+    }
+
+    ssize_t n_read = 0;
+    while (len > 0 && (n_read = read(in, buf, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE)) > 0) {
+        for (ssize_t done = 0; done < n_read; ) {
+            ssize_t n_written = write(out, buf + done, n_read - done);
+            if (n_written < 0) {
+                if (errno == EINTR) continue;
+                free(buf);
+                return -1;
+            }
+            done += n_written;
+        }
+        *copied += n_read;
+        len -= n_read;
+    }
+
+    free(buf);
+    return n_read >= 0 ? 0 : -1;
+}
+
+// Reserve len bytes at offset up front, so the file is laid out in one piece rather than
+// grown a write at a time. Filesystems that can't are written as before. The size is left
+// alone, so a copy cut short is visibly short rather than padded out with zeros, and a
+// trailing hole of a sparse file stays a hole.
+static void preallocate(int fd, long long offset, long long len)
+{
+#ifdef __linux__
+    if (len > 0) fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+#else
+    (void)fd;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+// Copy only the data extents of a file with holes, leaving the holes unallocated at out
+static int copy_sparse(int in, int out, long long size, long long *copied)
+{
+#ifdef SEEK_DATA
+    off_t data = 0;
+    while (data < size && (data = lseek(in, data, SEEK_DATA)) >= 0) {
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0 || lseek(in, data, SEEK_SET) < 0 || lseek(out, data, SEEK_SET) < 0) return -1;
+
+        preallocate(out, data, hole - data);
+        if (copy_data(in, out, hole - data, copied) != 0) return -1;
+        data = hole;
+    }
+    if (data < 0 && errno != ENXIO) return -1;
+
+    // Trailing holes
+    return ftruncate(out, size);
+#else
+    (void)size;
+    return copy_data(in, out, LLONG_MAX, copied);
+#endif
+}
+#endif
+
+void copy_metadata(int in, int out)
+{
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(in, &st) != 0) return;
+
+    // FAT and exFAT reject modes; the copy is still good without them
+    fchmod(out, st.st_mode & 07777);
+
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    futimens(out, times);
+#else
+    (void)in;
+    (void)out;
+#endif
+}
+
+int copy_file(const char *src, const char *dst, copystats_t *stats)
+{
+#ifdef _WIN32
+    // CopyFile keeps timestamps and attributes itself
+    if (!CopyFileA(src, dst, FALSE)) {
+        fprintf(stderr, "copy_file: Failed to copy %s to %s\n", src, dst);
+        return -1;
+    }
+
+    struct _stat64 st;
+    if (stats && _stat64(src, &st) == 0) {
+        stats->files++;
+        stats->bytes_copied += st.st_size;
+    }
+    return 0;
+#else
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "Failed to open source file: %s\n", src);
+        return -1;
+    }
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        fprintf(stderr, "copy_file: Failed to create destination file: %s\n", dst);
+        close(in);
+        return -1;
+    }
+
+    // A clone takes the whole file or nothing, so a failure leaves out empty to copy into
+    long long cloned = 0, copied = 0;
+    struct stat st;
+    int status = fstat(in, &st);
+    if (status == 0) {
+        if (st.st_size > 0 && clone_data(in, out) == 0) {
+            cloned = st.st_size;
+        } else if ((long long)st.st_blocks * 512 < (long long)st.st_size) {
+            status = copy_sparse(in, out, st.st_size, &copied);
+        } else {
+            preallocate(out, 0, st.st_size);
+            status = copy_data(in, out, LLONG_MAX, &copied);
+        }
+    }
+
+    if (status == 0) {
+        copy_metadata(in, out);
+    } else {
+        fprintf(stderr, "copy_file: Failed to write to destination file: %s\n", dst);
+    }
+
+    close(in);
+    if (close(out) != 0) status = -1;
+
+    if (status == 0 && stats) {
+        stats->files++;
+        stats->bytes_cloned += cloned;
+        stats->bytes_copied += copied;
+    }
+    return status;
+#endif
+}
+
+int copy_file_hashed(const char *src, const char *dst, uint8_t digest[32], copystats_t *stats)
+{
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open source file: %s\n", src);
+        return -1;
+    }
+
+    FILE *out = fopen(dst, "wb");
+    if (!out) {
+        fprintf(stderr, "copy_file_hashed: Failed to create destination file: %s\n", dst);
+        fclose(in);
+        return -1;
+    }
+
+    char *buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "copy_file_hashed: Failed to allocate copy buffer\n");
+        fclose(in);
+        fclose(out);
+        return -1;
+    }
+
+#ifndef _WIN32
+    struct stat st;
+    if (fstat(fileno(in), &st) == 0) preallocate(fileno(out), 0, st.st_size);
+#endif
+
+    struct Sha_256 sha_256;
+    sha_256_init(&sha_256, digest);
+
+    long long copied = 0;
+    int status = 0;
+    size_t n;
+    while ((n = fread(buf, 1, COPY_BUFFER_SIZE, in)) > 0) {
+        sha_256_write(&sha_256, buf, n);
+        if (fwrite(buf, 1, n, out) != n) {
+            fprintf(stderr, "copy_file_hashed: Failed to write to destination file: %s\n", dst);
+            status = -1;
+            break;
+        }
+        copied += n;
+    }
+    if (ferror(in)) status = -1;
+    sha_256_close(&sha_256);
+
+    // Flush first, or the final write would land after the timestamps are set
+    if (status == 0 && fflush(out) == 0) copy_metadata(fileno(in), fileno(out));
+
+    free(buf);
+    fclose(in);
+    if (fclose(out) != 0) status = -1;
+
+    if (status == 0 && stats) {
+        stats->files++;
+        stats->bytes_copied += copied;
+    }
+    return status;
+}
+
+int reflink_file(const char *src, const char *dst)
+{
+#ifdef _WIN32
+    (void)src;
+    (void)dst;
+    return -1;
+#else
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int status = clone_data(in, out);
+    close(in);
+    close(out);
+
+    if (status != 0) {
+        remove(dst);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+static int compare_job_size(const void *a, const void *b)
+{
+    long long size_a = (*(copyjob_t *const *)a)->size;
+    long long size_b = (*(copyjob_t *const *)b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+// Copy through a temporary file next to dst, so dst only ever holds a complete copy
+static int copy_file_atomic(const char *src, const char *dst, copystats_t *stats)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, dst) >= (int)sizeof(tmp)) return -1;
+
+    if (copy_file(src, tmp, stats) != 0) {
+        remove(tmp);
+        return -1;
+    }
+
+#ifdef _WIN32
+    remove(dst);
+#endif
+    if (rename(tmp, dst) != 0) {
+        fprintf(stderr, "copy_file: Failed to move %s into place\n", dst);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// As copy_file_atomic, for content that must match a digest taken earlier
+static int copy_file_verified(const char *src, const char *dst, const uint8_t expected[32], copystats_t *stats)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, dst) >= (int)sizeof(tmp)) return -1;
+
+    uint8_t digest[32];
+    if (copy_file_hashed(src, tmp, digest, stats) != 0) {
+        remove(tmp);
+        return -1;
+    }
+
+    if (memcmp(digest, expected, sizeof(digest)) != 0) {
+        fprintf(stderr, "copy_file: %s changed since it was hashed\n", src);
+        remove(tmp);
+        return -1;
+    }
+
+#ifdef _WIN32
+    remove(dst);
+#endif
+    if (rename(tmp, dst) != 0) {
+        fprintf(stderr, "copy_file: Failed to move %s into place\n", dst);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+size_t copy_files(copyjob_t *jobs, size_t count, int njobs, dircache_t *dirs, journal_t *journal, copystats_t *stats)
+{
+    copyjob_t **order = malloc(count * sizeof(copyjob_t *));
+    if (count && !order) {
+        fprintf(stderr, "copy_files: Failed to allocate copy queue\n");
+        for (size_t i = 0; i < count; i++) jobs[i].status = -1;
+        return count;
+    }
+
+    for (size_t i = 0; i < count; i++) order[i] = &jobs[i];
+    qsort(order, count, sizeof(copyjob_t *), compare_job_size);
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(njobs)
+    for (size_t i = 0; i < count; i++) {
+        copyjob_t *job = order[i];
+        memset(&job->stats, 0, sizeof(job->stats));
+        job->compressed = 0;
+        if (dircache_ensure_parent(dirs, job->dst) != 0) {
+            fprintf(stderr, "copy_files: Failed to create the parent directory of %s\n", job->dst);
+            job->status = -1;
+        } else if (job->map) {
+            job->status = delta_copy(job->src, job->dst, job->prev, job->map, &job->stats);
+        } else if (job->digest) {
+            job->status = copy_file_verified(job->src, job->dst, job->digest, &job->stats);
+        } else {
+            job->status = job->compress ? compress_file(job->src, job->dst, job->compress, &job->stats) : COMPRESS_STORED;
+            job->compressed = job->status == 0;
+            if (job->status == COMPRESS_STORED) job->status = copy_file_atomic(job->src, job->dst, &job->stats);
+        }
+
+        if (job->status == 0 && journal) journal_done(journal, job->dst);
+    }
+    free(order);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].status != 0) {
+            failed++;
+            continue;
+        }
+        stats->files += jobs[i].stats.files;
+        stats->bytes_cloned += jobs[i].stats.bytes_cloned;
+        stats->bytes_copied += jobs[i].stats.bytes_copied;
+        stats->bytes_unchanged += jobs[i].stats.bytes_unchanged;
+        stats->bytes_compressed += jobs[i].stats.bytes_compressed;
+        stats->bytes_stored += jobs[i].stats.bytes_stored;
+    }
+    return failed;
+}
+
+void copystats_print(const copystats_t *stats, FILE *out)
+{
+    fprintf(out, "Copied %zu files: %lld bytes cloned, %lld bytes copied",
+            stats->files, stats->bytes_cloned, stats->bytes_copied);
+    if (stats->bytes_unchanged) fprintf(out, ", %lld bytes unchanged", stats->bytes_unchanged);
+    if (stats->bytes_compressed) fprintf(out, ", %lld bytes compressed to %lld", stats->bytes_compressed, stats->bytes_stored);
+    fprintf(out, "\n");
+}
+
+int move_file(const char *src, const char *dst)
+{
+    if (rename(src, dst) != 0) {
+        return -1;
+    }
+    return 0;
+}
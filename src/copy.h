@@ -0,0 +1,107 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <omp.h>
+#include "arena.h"
+#include "journal.h"
+
+// Copy stage of --copy-to
+#define COPY_BUFFER_SIZE (1 << 20) // Read/write fallback when the kernel cannot copy for us
+#define COPY_DEFAULT_JOBS 4        // Copies in flight at once, see copy_files
+
+typedef struct {
+    size_t files;
+    long long bytes_cloned;  // Shared with the source through a reflink, no data written
+    long long bytes_copied;
+    long long bytes_unchanged; // Left in place at the destination by a delta copy
+    long long bytes_compressed; // Read by compress_file, not counted in bytes_copied
+    long long bytes_stored;     // What bytes_compressed came to at the destination
+} copystats_t;
+
+struct blockmap;
+
+typedef struct {
+    const char *src;
+    const char *dst;
+    long long size;         // Expected size, for scheduling only
+    int status;             // Result of copy_file, set by copy_files
+    copystats_t stats;
+    const struct blockmap *prev; // Block digests of the current copy at dst, may be NULL
+    struct blockmap *map;   // If set, copy with delta_copy and record the new block digests here
+    int compress;           // zlib level for compress_file, 0 to copy as is
+    int compressed;         // Set by copy_files if the copy was stored as dst COMPRESS_SUFFIX
+    const uint8_t *digest;  // If set, the copy is only kept if src still hashes to this
+} copyjob_t;
+
+// Create path and every missing parent
+void ensure_directory_exists(const char *path);
+void ensure_parent_exists(const char *dst);
+
+// Directories already created under a destination root, so each one costs a single mkdir
+// per run however many files are copied into it. Directories are created parents first,
+// relative to an open descriptor of the root (mkdirat), so no full path is walked again.
+typedef struct {
+    const char *root;
+    size_t root_len;
+    int root_fd;            // Opened on first use, -1 until then
+    char **slots;           // Open addressing set of paths relative to root
+    size_t nslots;          // Power of two
+    size_t len;
+    arena_t arena;
+    omp_lock_t lock;
+} dircache_t;
+
+void dircache_init(dircache_t *cache, const char *root);
+
+// Thread-safe. Create the parent directory of path; paths outside the root, or a NULL
+// cache, fall back to ensure_parent_exists.
+int dircache_ensure_parent(dircache_t *cache, const char *path);
+
+// Remove a batch of files under the root, then every directory they leave empty, deepest
+// first. Files are grouped by directory and unlinked relative to one descriptor per
+// directory (unlinkat). status[i] receives 0 if paths[i] is gone, including when it was
+// already missing. Returns the number of paths that could not be removed.
+size_t dircache_remove(dircache_t *cache, const char *const *paths, size_t count, int *status);
+
+void dircache_free(dircache_t *cache);
+
+// Copy src over dst, cloning it with FICLONE when both live on a copy-on-write filesystem
+// and otherwise keeping the data inside the kernel where possible: copy_file_range (which
+// also lets the filesystem copy server side), then sendfile, then a plain read/write loop.
+// Space is preallocated, holes in sparse files are skipped rather than filled, and the mode
+// and timestamps of src are applied to dst through its open descriptor. On Windows this is
+// CopyFile. The parent of dst must exist. stats may be NULL.
+int copy_file(const char *src, const char *dst, copystats_t *stats);
+
+// Give out the permissions and timestamps of in. Best effort: destinations that can't hold
+// them still get the data.
+void copy_metadata(int in, int out);
+
+// Read src once, feeding every buffer both to SHA-256 and to dst, so a changed file can be
+// hashed and backed up for the price of one read. digest receives the raw hash. The parent
+// of dst must exist.
+int copy_file_hashed(const char *src, const char *dst, uint8_t digest[32], copystats_t *stats);
+
+// Create dst as a reflink of src. Fails if dst exists or the filesystem cannot clone.
+int reflink_file(const char *src, const char *dst);
+
+// Run copy_file, or delta_copy for jobs with a map, compress_file for jobs with a
+// compression level and a hashing copy for jobs with a digest, for every job on up to
+// njobs threads.
+// Jobs are started largest first, so a big file never ends up starting last while small
+// ones fill the remaining slots. Each job keeps its own result; the totals are added to
+// stats. Files are written under a temporary name and renamed into place, so dst is never
+// left half written. Parent directories are created through dirs and finished files are
+// reported to journal; both may be NULL. Returns the number of failed jobs.
+size_t copy_files(copyjob_t *jobs, size_t count, int njobs, dircache_t *dirs, journal_t *journal, copystats_t *stats);
+
+void copystats_print(const copystats_t *stats, FILE *out);
+
+// Move a file that already exists at the destination instead of transferring it again.
+// The parent of dst must exist.
+int move_file(const char *src, const char *dst);
+
+#endif
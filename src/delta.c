@@ -0,0 +1,428 @@
+#include "delta.h"
+#include "sha-256.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+    char magic[8];
+    uint32_t block_size;
+    uint32_t reserved;
+    uint64_t count;
+} blockstore_header_t;
+
+typedef struct {
+    uint32_t path_len;
+    uint32_t reserved;
+    int64_t size;
+    int64_t mtime;
+    uint64_t nblocks;
+} blockmap_header_t;
+
+static int stat_file(const char *path, long long *size, long long *mtime)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+
+    *size = (long long)st.st_size;
+    *mtime = (long long)st.st_mtime;
+    return 0;
+}
+
+static int compare_maps(const void *a, const void *b)
+{
+    return strcmp(((const blockmap_t *)a)->path, ((const blockmap_t *)b)->path);
+}
+
+static void store_path(char *out, size_t size, const char *dst_root)
+{
+    snprintf(out, size, "%s/%s", dst_root, DELTA_FILE);
+}
+
+void blockmap_free(blockmap_t *map)
+{
+    free(map->path);
+    free(map->digests);
+    map->path = NULL;
+    map->digests = NULL;
+    map->nblocks = 0;
+}
+
+void blockstore_free(blockstore_t *store)
+{
+    for (size_t i = 0; i < store->len; i++) {
+        blockmap_free(&store->maps[i]);
+    }
+    free(store->maps);
+    store->maps = NULL;
+    store->len = 0;
+    store->capacity = 0;
+}
+
+static int blockstore_grow(blockstore_t *store)
+{
+    if (store->len < store->capacity) return 0;
+
+    size_t new_capacity = store->capacity ? store->capacity * 2 : 64;
+    blockmap_t *maps = realloc(store->maps, new_capacity * sizeof(blockmap_t));
+    if (!maps) return -1;
+
+    store->maps = maps;
+    store->capacity = new_capacity;
+    return 0;
+}
+
+static int read_map(FILE *fp, blockmap_t *map)
+{
+    blockmap_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1) return -1;
+
+    // Anything implausible means the file is damaged
+    if (header.path_len == 0 || header.path_len >= PATH_MAX || header.size < 0) return -1;
+    if (header.nblocks != (uint64_t)((header.size + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE)) return -1;
+
+    map->path = malloc(header.path_len + 1);
+    map->digests = malloc(header.nblocks ? header.nblocks * 32 : 1);
+    map->nblocks = header.nblocks;
+    map->size = header.size;
+    map->mtime = header.mtime;
+    if (!map->path || !map->digests
+        || fread(map->path, 1, header.path_len, fp) != header.path_len
+        || fread(map->digests, 32, header.nblocks, fp) != header.nblocks) {
+        blockmap_free(map);
+        return -1;
+    }
+
+    map->path[header.path_len] = '\0';
+    return 0;
+}
+
+int blockstore_load(blockstore_t *store, const char *dst_root)
+{
+    memset(store, 0, sizeof(*store));
+
+    char path[PATH_MAX];
+    store_path(path, sizeof(path), dst_root);
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+
+    blockstore_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, DELTA_MAGIC, sizeof(header.magic)) != 0
+        || header.block_size != DELTA_BLOCK_SIZE) {
+        fclose(fp);
+        return 0;
+    }
+
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (blockstore_grow(store) != 0 || read_map(fp, &store->maps[store->len]) != 0) {
+            fprintf(stderr, "blockstore_load: Ignoring damaged %s\n", path);
+            blockstore_free(store);
+            break;
+        }
+        store->len++;
+    }
+
+    fclose(fp);
+    qsort(store->maps, store->len, sizeof(blockmap_t), compare_maps);
+    return 0;
+}
+
+// Index of the first map whose path is not less than path
+static size_t blockstore_lower_bound(const blockstore_t *store, const char *path)
+{
+    size_t lo = 0, hi = store->len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(store->maps[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+const blockmap_t *blockstore_find(const blockstore_t *store, const char *path)
+{
+    size_t i = blockstore_lower_bound(store, path);
+    if (i < store->len && strcmp(store->maps[i].path, path) == 0) return &store->maps[i];
+    return NULL;
+}
+
+int blockstore_put(blockstore_t *store, blockmap_t *map)
+{
+    size_t i = blockstore_lower_bound(store, map->path);
+    if (i < store->len && strcmp(store->maps[i].path, map->path) == 0) {
+        blockmap_free(&store->maps[i]);
+        store->maps[i] = *map;
+        return 0;
+    }
+
+    if (blockstore_grow(store) != 0) {
+        fprintf(stderr, "blockstore_put: Failed to grow block store\n");
+        return -1;
+    }
+
+    memmove(&store->maps[i + 1], &store->maps[i], (store->len - i) * sizeof(blockmap_t));
+    store->maps[i] = *map;
+    store->len++;
+    return 0;
+}
+
+int blockstore_save(const blockstore_t *store, const char *dst_root)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    store_path(path, sizeof(path), dst_root);
+    snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, path);
+
+    // Only keep maps that still describe the file at the destination
+    unsigned char *live = calloc(store->len ? store->len : 1, 1);
+    if (!live) {
+        fprintf(stderr, "blockstore_save: Failed to allocate\n");
+        return -1;
+    }
+
+    blockstore_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DELTA_MAGIC, sizeof(header.magic));
+    header.block_size = DELTA_BLOCK_SIZE;
+
+    for (size_t i = 0; i < store->len; i++) {
+        char file[PATH_MAX];
+        long long size, mtime;
+        snprintf(file, sizeof(file), "%s/%s", dst_root, store->maps[i].path);
+        if (stat_file(file, &size, &mtime) == 0 && size == store->maps[i].size && mtime == store->maps[i].mtime) {
+            live[i] = 1;
+            header.count++;
+        }
+    }
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        fprintf(stderr, "blockstore_save: Failed to open %s\n", tmp);
+        free(live);
+        return -1;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (size_t i = 0; ok && i < store->len; i++) {
+        if (!live[i]) continue;
+
+        const blockmap_t *map = &store->maps[i];
+        blockmap_header_t map_header;
+        memset(&map_header, 0, sizeof(map_header));
+        map_header.path_len = (uint32_t)strlen(map->path);
+        map_header.size = map->size;
+        map_header.mtime = map->mtime;
+        map_header.nblocks = map->nblocks;
+
+        ok = fwrite(&map_header, sizeof(map_header), 1, fp) == 1
+          && fwrite(map->path, 1, map_header.path_len, fp) == map_header.path_len
+          && fwrite(map->digests, 32, map->nblocks, fp) == map->nblocks;
+    }
+    free(live);
+
+    if (fclose(fp) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "blockstore_save: Failed to write %s\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Room for the digests of a file of the given size
+static int blockmap_reserve(blockmap_t *map, size_t nblocks, size_t *capacity)
+{
+    if (nblocks <= *capacity) return 0;
+
+    size_t new_capacity = *capacity ? *capacity * 2 : 16;
+    if (new_capacity < nblocks) new_capacity = nblocks;
+
+    uint8_t (*digests)[32] = realloc(map->digests, new_capacity * 32);
+    if (!digests) return -1;
+
+    map->digests = digests;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Copy src whole to a temporary file, recording block digests, and rename it over dst
+static int delta_copy_full(const char *src, const char *dst, blockmap_t *map, copystats_t *stats, char *buf)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, dst) >= (int)sizeof(tmp)) return -1;
+
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open source file: %s\n", src);
+        return -1;
+    }
+
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fprintf(stderr, "delta_copy: Failed to create destination file: %s\n", tmp);
+        fclose(in);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    long long copied = 0;
+    int status = 0;
+    size_t n;
+    map->nblocks = 0;
+    while ((n = fread(buf, 1, DELTA_BLOCK_SIZE, in)) > 0) {
+        if (blockmap_reserve(map, map->nblocks + 1, &capacity) != 0 || fwrite(buf, 1, n, out) != n) {
+            status = -1;
+            break;
+        }
+        calc_sha_256(map->digests[map->nblocks++], buf, n);
+        copied += n;
+    }
+    if (ferror(in)) status = -1;
+    if (status == 0 && fflush(out) == 0) copy_metadata(fileno(in), fileno(out));
+
+    fclose(in);
+    if (fclose(out) != 0) status = -1;
+
+#ifdef _WIN32
+    if (status == 0) remove(dst);
+#endif
+    if (status != 0 || rename(tmp, dst) != 0) {
+        fprintf(stderr, "delta_copy: Failed to write to destination file: %s\n", dst);
+        remove(tmp);
+        return -1;
+    }
+
+    if (stat_file(dst, &map->size, &map->mtime) != 0) return -1;
+    stats->files++;
+    stats->bytes_copied += copied;
+    return 0;
+}
+
+#ifndef _WIN32
+static ssize_t read_block(int fd, char *buf)
+{
+    size_t done = 0;
+    while (done < DELTA_BLOCK_SIZE) {
+        ssize_t n = read(fd, buf + done, DELTA_BLOCK_SIZE - done);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static int write_block(int fd, const char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Rewrite only the blocks of dst whose digest no longer matches prev
+static int delta_copy_blocks(const char *src, const char *dst, const blockmap_t *prev, blockmap_t *map, copystats_t *stats, char *buf)
+{
+    int in = open(src, O_RDONLY);
+    if (in < 0) return -1;
+
+    int out = open(dst, O_RDWR);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    size_t capacity = 0;
+    long long copied = 0, unchanged = 0;
+    off_t offset = 0;
+    int status = 0;
+    ssize_t n;
+    map->nblocks = 0;
+    while ((n = read_block(in, buf)) > 0) {
+        if (blockmap_reserve(map, map->nblocks + 1, &capacity) != 0) {
+            status = -1;
+            break;
+        }
+
+        size_t i = map->nblocks++;
+        calc_sha_256(map->digests[i], buf, n);
+
+        // A short last block has a different digest from the full block it replaces
+        if (i < prev->nblocks && memcmp(map->digests[i], prev->digests[i], 32) == 0) {
+            unchanged += n;
+        } else if (write_block(out, buf, n, offset) != 0) {
+            status = -1;
+            break;
+        } else {
+            copied += n;
+        }
+        offset += n;
+    }
+    if (n < 0) status = -1;
+
+    struct stat st;
+    if (status == 0 && offset != prev->size && ftruncate(out, offset) != 0) status = -1;
+    if (status == 0) copy_metadata(in, out);
+    if (status == 0 && fstat(out, &st) != 0) status = -1;
+
+    close(in);
+    if (close(out) != 0) status = -1;
+    if (status != 0) return -1;
+
+    map->size = (long long)st.st_size;
+    map->mtime = (long long)st.st_mtime;
+    stats->files++;
+    stats->bytes_copied += copied;
+    stats->bytes_unchanged += unchanged;
+    return 0;
+}
+#endif
+
+int delta_copy(const char *src, const char *dst, const blockmap_t *prev, blockmap_t *map, copystats_t *stats)
+{
+    char *buf = malloc(DELTA_BLOCK_SIZE);
+    if (!buf) {
+        fprintf(stderr, "delta_copy: Failed to allocate block buffer\n");
+        return -1;
+    }
+
+    copystats_t local = { 0 };
+    int status = -1;
+
+#ifndef _WIN32
+    long long size, mtime;
+    if (prev && stat_file(dst, &size, &mtime) == 0 && size == prev->size && mtime == prev->mtime) {
+        status = delta_copy_blocks(src, dst, prev, map, &local, buf);
+        if (status != 0) {
+            // dst may be partly patched; a whole copy puts it right
+            memset(&local, 0, sizeof(local));
+        }
+    }
+#else
+    (void)prev;
+#endif
+
+    if (status != 0) status = delta_copy_full(src, dst, map, &local, buf);
+    free(buf);
+
+    if (status == 0 && stats) {
+        stats->files += local.files;
+        stats->bytes_copied += local.bytes_copied;
+        stats->bytes_unchanged += local.bytes_unchanged;
+    }
+    return status;
+}
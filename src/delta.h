@@ -0,0 +1,54 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "copy.h"
+
+// Block-level updates of large files at the destination. The SHA-256 of every block of a
+// file is recorded when it is copied, so the next copy can rewrite only the blocks whose
+// digest changed instead of the whole file.
+#define DELTA_MAGIC "USBDBLK1"
+#define DELTA_BLOCK_SIZE (1 << 20)
+#define DELTA_MIN_SIZE (16LL << 20)         // Smaller files are cheaper to copy whole
+#define DELTA_FILE ".usbdiff.blocks"        // Kept at the root of the destination it describes
+
+struct blockmap {
+    char *path;             // Relative to the destination root
+    long long size;         // Size and mtime of the destination file when it was recorded,
+    long long mtime;        // so a copy changed by anything else is never patched
+    size_t nblocks;
+    uint8_t (*digests)[32];
+};
+
+typedef struct blockmap blockmap_t;
+
+typedef struct {
+    blockmap_t *maps;       // Sorted by path
+    size_t len;
+    size_t capacity;
+} blockstore_t;
+
+// Load the block maps saved at the root of a destination. A missing or unreadable file
+// leaves the store empty.
+int blockstore_load(blockstore_t *store, const char *dst_root);
+
+const blockmap_t *blockstore_find(const blockstore_t *store, const char *path);
+
+// Take ownership of map, replacing any previous map for the same path
+int blockstore_put(blockstore_t *store, blockmap_t *map);
+
+// Save the store, dropping maps whose destination file has since changed or disappeared
+int blockstore_save(const blockstore_t *store, const char *dst_root);
+
+void blockstore_free(blockstore_t *store);
+void blockmap_free(blockmap_t *map);
+
+// Bring dst up to date with src. If prev still describes dst, only blocks whose digest
+// differs are rewritten in place and dst is truncated or extended to the new size. Otherwise
+// src is copied whole to a temporary file that is renamed over dst, so dst is never left half
+// written. map receives the digests of the new content either way; map->path is left as is.
+// The parent of dst must exist.
+int delta_copy(const char *src, const char *dst, const blockmap_t *prev, blockmap_t *map, copystats_t *stats);
+
+#endif
@@ -0,0 +1,279 @@
+#include "diff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+// Below this many records in total the diff stays on one thread
+#define DIFF_PARALLEL_THRESHOLD (1 << 16)
+#define DIFF_PARTITIONS_PER_THREAD 4
+
+static inline int compare_records(const findex_t *curr_index, size_t j, const findex_t *prev_index, size_t i)
+{
+    if (i >= findex_count(prev_index)) return 1;
+    if (j >= findex_count(curr_index)) return -1;
+    return strcmp(findex_filename(prev_index, &prev_index->records[i]), findex_filename(curr_index, &curr_index->records[j]));
+}
+
+int find_renames(renames_t *renames, const findex_t *curr_index, const findex_t *prev_index)
+{
+    size_t prev_count = findex_count(prev_index);
+    size_t curr_count = findex_count(curr_index);
+
+    renames->renamed_from = malloc((curr_count ? curr_count : 1) * sizeof(uint32_t));
+    renames->claimed = calloc(prev_count ? prev_count : 1, 1);
+
+    unsigned char *deleted = calloc(prev_count ? prev_count : 1, 1);
+    uint32_t *added = malloc((curr_count ? curr_count : 1) * sizeof(uint32_t));
+    uint32_t *skip = NULL;
+    fdigests_t digests = { NULL, 0 };
+    int status = -1;
+
+    if (!renames->renamed_from || !renames->claimed || !deleted || !added) {
+        fprintf(stderr, "find_renames: Failed to allocate rename tables\n");
+        goto cleanup;
+    }
+
+    for (size_t j = 0; j < curr_count; j++) renames->renamed_from[j] = FINDEX_EMPTY_SLOT;
+
+    // Sequential merge to find which paths disappeared and which appeared
+    size_t added_count = 0, deleted_count = 0;
+    size_t i = 0, j = 0;
+    while (i < prev_count || j < curr_count) {
+        int cmp = compare_records(curr_index, j, prev_index, i);
+        if (cmp < 0) {
+            deleted[i++] = 1;
+            deleted_count++;
+        } else if (cmp > 0) {
+            // Empty files all share one digest, pairing them would be noise
+            if (curr_index->records[j].file_size > 0) added[added_count++] = (uint32_t)j;
+            j++;
+        } else {
+            i++;
+            j++;
+        }
+    }
+
+    if (added_count && deleted_count) {
+        if (fdigests_build(&digests, prev_index)) goto cleanup;
+
+        // Per digest group, how many leading candidates are already known to be unusable
+        skip = calloc(digests.count ? digests.count : 1, sizeof(uint32_t));
+        if (!skip) {
+            fprintf(stderr, "find_renames: Failed to allocate rename tables\n");
+            goto cleanup;
+        }
+
+        for (size_t a = 0; a < added_count; a++) {
+            const findex_record_t *curr_entry = &curr_index->records[added[a]];
+
+            size_t first;
+            size_t n = fdigests_find(&digests, curr_entry->digest, &first);
+            if (!n) continue;
+
+            uint32_t *group_skip = &skip[first];
+            while (*group_skip < n) {
+                uint32_t p = digests.entries[first + *group_skip].record;
+                if (deleted[p] && !renames->claimed[p]) break;
+                (*group_skip)++;
+            }
+
+            for (size_t k = *group_skip; k < n; k++) {
+                uint32_t p = digests.entries[first + k].record;
+                if (!deleted[p] || renames->claimed[p]) continue;
+                if (memcmp(prev_index->records[p].digest, curr_entry->digest, sizeof(curr_entry->digest)) != 0) continue;
+
+                renames->claimed[p] = 1;
+                renames->renamed_from[added[a]] = p;
+                break;
+            }
+        }
+    }
+
+    status = 0;
+
+cleanup:
+    free(deleted);
+    free(added);
+    free(skip);
+    fdigests_free(&digests);
+    if (status) renames_free(renames);
+    return status;
+}
+
+void renames_free(renames_t *renames)
+{
+    free(renames->renamed_from);
+    free(renames->claimed);
+    renames->renamed_from = NULL;
+    renames->claimed = NULL;
+}
+
+// Merge prev records [i, prev_end) against curr records [j, curr_end)
+static size_t diff_range(const findex_t *curr_index, size_t j, size_t curr_end,
+                         const findex_t *prev_index, size_t i, size_t prev_end,
+                         const renames_t *renames, diff_callback_t callback, void *ctx)
+{
+    size_t diff_count = 0;
+
+    while (i < prev_end || j < curr_end) {
+        const findex_record_t *prev_entry = i < prev_end ? &prev_index->records[i] : NULL;
+        const findex_record_t *curr_entry = j < curr_end ? &curr_index->records[j] : NULL;
+
+        int cmp;
+        if (!prev_entry) cmp = 1;
+        else if (!curr_entry) cmp = -1;
+        else cmp = strcmp(findex_filename(prev_index, prev_entry), findex_filename(curr_index, curr_entry));
+
+        filediff_t diff;
+        diff.old_filename = NULL;
+
+        if (cmp < 0) {
+            // File Deleted, unless it was renamed and is reported with its new path
+            int renamed = renames && renames->claimed[i];
+            diff.filename = findex_filename(prev_index, prev_entry);
+            diff.file_size = prev_entry->file_size;
+            diff.status = DELETED;
+            i++;
+
+            if (renamed) continue;
+        } else if (cmp > 0) {
+            // New file created, or an old one renamed
+            uint32_t from = renames ? renames->renamed_from[j] : FINDEX_EMPTY_SLOT;
+            diff.filename = findex_filename(curr_index, curr_entry);
+            diff.file_size = curr_entry->file_size;
+            diff.status = ADDED;
+            if (from != FINDEX_EMPTY_SLOT) {
+                diff.status = RENAMED;
+                diff.old_filename = findex_filename(prev_index, &prev_index->records[from]);
+            }
+            j++;
+        } else {
+            // File Modified, or Unchanged if the digests match
+            int changed = memcmp(prev_entry->digest, curr_entry->digest, sizeof(prev_entry->digest)) != 0;
+            diff.filename = findex_filename(curr_index, curr_entry);
+            diff.file_size = curr_entry->file_size;
+            diff.status = MODIFIED;
+            i++;
+            j++;
+
+            if (!changed) continue;
+        }
+
+        diff_count++;
+        if (callback && callback(&diff, ctx)) break;
+    }
+
+    return diff_count;
+}
+
+// First record of idx whose filename is not less than key
+static size_t lower_bound(const findex_t *idx, const char *key)
+{
+    size_t lo = 0, hi = findex_count(idx);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(findex_filename(idx, &idx->records[mid]), key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t map_diff(const findex_t *curr_index, const findex_t *prev_index, const renames_t *renames, diff_callback_t callback, void *ctx)
+{
+    size_t prev_count = findex_count(prev_index);
+    size_t curr_count = findex_count(curr_index);
+
+    int nparts = 1;
+    if (prev_count + curr_count >= DIFF_PARALLEL_THRESHOLD) {
+        nparts = omp_get_max_threads() * DIFF_PARTITIONS_PER_THREAD;
+    }
+
+    if (nparts == 1) {
+        return diff_range(curr_index, 0, curr_count, prev_index, 0, prev_count, renames, callback, ctx);
+    }
+
+    // Split the key space at evenly spaced paths of the larger snapshot. Each partition is an
+    // independent merge of the matching record ranges on both sides.
+    size_t *prev_bounds = malloc((nparts + 1) * sizeof(size_t));
+    size_t *curr_bounds = malloc((nparts + 1) * sizeof(size_t));
+    if (!prev_bounds || !curr_bounds) {
+        free(prev_bounds);
+        free(curr_bounds);
+        return diff_range(curr_index, 0, curr_count, prev_index, 0, prev_count, renames, callback, ctx);
+    }
+
+    const findex_t *split_index = curr_count >= prev_count ? curr_index : prev_index;
+    size_t split_count = findex_count(split_index);
+
+    prev_bounds[0] = curr_bounds[0] = 0;
+    prev_bounds[nparts] = prev_count;
+    curr_bounds[nparts] = curr_count;
+    for (int p = 1; p < nparts; p++) {
+        const char *key = findex_filename(split_index, &split_index->records[split_count * p / nparts]);
+        prev_bounds[p] = lower_bound(prev_index, key);
+        curr_bounds[p] = lower_bound(curr_index, key);
+    }
+
+    size_t diff_count = 0;
+    int stopped = 0;
+
+    // Each partition diffs into its own buffer; the buffers are handed to callback strictly in
+    // partition order, so the output is the same as the sequential merge
+    #pragma omp parallel for ordered schedule(static, 1) reduction(+:diff_count)
+    for (int p = 0; p < nparts; p++) {
+        difflist_t local;
+        difflist_init(&local);
+
+        diff_range(curr_index, curr_bounds[p], curr_bounds[p + 1],
+                   prev_index, prev_bounds[p], prev_bounds[p + 1],
+                   renames, difflist_push, &local);
+
+        #pragma omp ordered
+        {
+            for (size_t k = 0; k < local.len && !stopped; k++) {
+                diff_count++;
+                if (callback && callback(&local.items[k], ctx)) stopped = 1;
+            }
+        }
+
+        difflist_free(&local);
+    }
+
+    free(prev_bounds);
+    free(curr_bounds);
+    return diff_count;
+}
+
+void difflist_init(difflist_t *list)
+{
+    list->items = NULL;
+    list->len = 0;
+    list->capacity = 0;
+}
+
+int difflist_push(const filediff_t *diff, void *ctx)
+{
+    difflist_t *list = ctx;
+
+    if (list->len == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 256;
+        filediff_t *items = realloc(list->items, new_capacity * sizeof(filediff_t));
+        if (!items) {
+            fprintf(stderr, "difflist_push: Failed to grow diff list\n");
+            return -1;
+        }
+
+        list->items = items;
+        list->capacity = new_capacity;
+    }
+
+    list->items[list->len++] = *diff;
+    return 0;
+}
+
+void difflist_free(difflist_t *list)
+{
+    free(list->items);
+    difflist_init(list);
+}
@@ -0,0 +1,47 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "usbdiff.h"
+#include "findex.h"
+
+// Called once per change, as soon as it is found. The filediff_t and its filename are only
+// borrowed: filename points into one of the indexes being diffed. Return non-zero to stop.
+typedef int (*diff_callback_t)(const filediff_t *diff, void *ctx);
+
+// Content-based pairing of deleted and new files. A new, non-empty file whose digest matches
+// a file that disappeared from prev is reported as RENAMED instead of DELETED plus ADDED.
+typedef struct {
+    uint32_t *renamed_from;     // Per curr record: prev record it was renamed from, or FINDEX_EMPTY_SLOT
+    unsigned char *claimed;     // Per prev record: non-zero if it is the source of a rename
+} renames_t;
+
+// Build a digest-to-paths index over prev and pair up renames. Pairing is deterministic:
+// new files in path order each take the first unclaimed deleted path with their content.
+int find_renames(renames_t *renames, const findex_t *curr_index, const findex_t *prev_index);
+void renames_free(renames_t *renames);
+
+// Diff two frozen snapshots with a sequential merge over their path-sorted records. Large
+// snapshots are split into path ranges merged by worker threads; callback is still called
+// once at a time and in path order, but from whichever worker merged the range, so it must
+// not rely on thread-local state. Only one range's worth of changes is buffered per worker,
+// so there is no limit on the number of changes. Both indexes are only read front to back,
+// so mapped snapshots larger than memory are streamed through the page cache. renames may
+// be NULL.
+// Returns the number of changes reported.
+size_t map_diff(const findex_t *curr_index, const findex_t *prev_index, const renames_t *renames, diff_callback_t callback, void *ctx);
+
+// Growable sink for consumers that need to keep changes around after map_diff returns
+typedef struct {
+    filediff_t *items;
+    size_t len;
+    size_t capacity;
+} difflist_t;
+
+void difflist_init(difflist_t *list);
+
+// diff_callback_t that appends to the difflist_t passed as ctx
+int difflist_push(const filediff_t *diff, void *ctx);
+
+void difflist_free(difflist_t *list);
+
+#endif
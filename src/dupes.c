@@ -0,0 +1,273 @@
+#include "dupes.h"
+#include "copy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct {
+    int64_t file_size;
+    uint64_t prefix;
+    uint32_t record;
+} dupekey_t;
+
+typedef struct {
+    size_t sets;
+    size_t files;
+    long long reclaimable;
+    size_t linked;
+    size_t failed;
+} dupestats_t;
+
+static int compare_sizes(const void *a, const void *b)
+{
+    int64_t sa = *(const int64_t *)a;
+    int64_t sb = *(const int64_t *)b;
+    return (sa > sb) - (sa < sb);
+}
+
+// Largest files first, then by digest; ties by record keep each set in path order
+static int compare_keys(const void *a, const void *b)
+{
+    const dupekey_t *ka = a;
+    const dupekey_t *kb = b;
+
+    if (ka->file_size != kb->file_size) return ka->file_size > kb->file_size ? -1 : 1;
+    if (ka->prefix != kb->prefix) return ka->prefix < kb->prefix ? -1 : 1;
+    if (ka->record != kb->record) return ka->record < kb->record ? -1 : 1;
+    return 0;
+}
+
+static int size_is_shared(const int64_t *shared, size_t count, int64_t size)
+{
+    return bsearch(&size, shared, count, sizeof(int64_t), compare_sizes) != NULL;
+}
+
+// The snapshot may be stale: only touch files whose size and mtime still match it
+static int matches_snapshot(const char *path, const findex_record_t *rec, struct stat *st)
+{
+    if (stat(path, st) != 0) return 0;
+    return (int64_t)st->st_size == rec->file_size && (int64_t)st->st_mtime == rec->mtime;
+}
+
+static int link_duplicate(const char *original, const char *duplicate, dupes_mode_t mode)
+{
+    // Build the link under a temporary name next to the duplicate and swap it in, so the
+    // duplicate is never missing
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.usbdiff-link", duplicate);
+    remove(tmp);
+
+    int status;
+    if (mode == DUPES_HARDLINK) {
+#ifdef _WIN32
+        status = CreateHardLinkA(tmp, original, NULL) ? 0 : -1;
+#else
+        status = link(original, tmp);
+#endif
+    } else {
+        status = reflink_file(original, tmp);
+#ifndef _WIN32
+        struct stat st;
+        if (status == 0 && stat(duplicate, &st) == 0) chmod(tmp, st.st_mode & 07777);
+#endif
+    }
+    if (status != 0) return -1;
+
+#ifdef _WIN32
+    remove(duplicate);
+#endif
+    if (rename(tmp, duplicate) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Report, and optionally link, one set of files sharing size and digest
+static void handle_set(const findex_t *idx, const uint32_t *members, size_t count, dupes_mode_t mode, dupestats_t *stats)
+{
+    const findex_record_t *first = &idx->records[members[0]];
+    const char *original = findex_filename(idx, first);
+
+    stats->sets++;
+    stats->files += count - 1;
+    stats->reclaimable += first->file_size * (long long)(count - 1);
+
+    char hex[65];
+    findex_hex(first, hex);
+    printf("\n%zu copies of %lld bytes (%.12s):\n", count, (long long)first->file_size, hex);
+    printf("\t%s\n", original);
+
+    struct stat original_st;
+    int original_ok = mode != DUPES_REPORT && matches_snapshot(original, first, &original_st);
+
+    for (size_t k = 1; k < count; k++) {
+        const findex_record_t *rec = &idx->records[members[k]];
+        const char *duplicate = findex_filename(idx, rec);
+        printf("\t%s\n", duplicate);
+
+        if (mode == DUPES_REPORT) continue;
+
+        struct stat st;
+        if (!original_ok || !matches_snapshot(duplicate, rec, &st)) {
+            fprintf(stderr, "Skipping %s: changed since the snapshot was taken\n", duplicate);
+            stats->failed++;
+            continue;
+        }
+
+#ifndef _WIN32
+        // Already the same file
+        if (mode == DUPES_HARDLINK && st.st_dev == original_st.st_dev && st.st_ino == original_st.st_ino) continue;
+#endif
+
+        if (link_duplicate(original, duplicate, mode) != 0) {
+            fprintf(stderr, "Failed to %s %s to %s\n", mode == DUPES_HARDLINK ? "hardlink" : "reflink", duplicate, original);
+            stats->failed++;
+        } else {
+            stats->linked++;
+        }
+    }
+}
+
+typedef struct {
+    uint8_t digest[32];
+    uint32_t record;
+} fulldigest_t;
+
+static int compare_full_digests(const void *a, const void *b)
+{
+    const fulldigest_t *fa = a;
+    const fulldigest_t *fb = b;
+
+    int cmp = memcmp(fa->digest, fb->digest, sizeof(fa->digest));
+    if (cmp) return cmp;
+    return (fa->record > fb->record) - (fa->record < fb->record);
+}
+
+// Split a run of records sharing size and digest prefix into sets of identical digests
+static void handle_run(const findex_t *idx, uint32_t *members, size_t count, dupes_mode_t mode, dupestats_t *stats)
+{
+    size_t k;
+    for (k = 1; k < count; k++) {
+        if (memcmp(idx->records[members[k]].digest, idx->records[members[0]].digest, 32) != 0) break;
+    }
+
+    if (k == count) {
+        handle_set(idx, members, count, mode, stats);
+        return;
+    }
+
+    // Prefix collision: sort the run by full digest
+    fulldigest_t *full = malloc(count * sizeof(fulldigest_t));
+    if (!full) {
+        fprintf(stderr, "find_dupes: Failed to allocate digest table\n");
+        return;
+    }
+
+    for (k = 0; k < count; k++) {
+        memcpy(full[k].digest, idx->records[members[k]].digest, 32);
+        full[k].record = members[k];
+    }
+    qsort(full, count, sizeof(fulldigest_t), compare_full_digests);
+
+    for (size_t i = 0; i < count; ) {
+        size_t j = i + 1;
+        while (j < count && memcmp(full[j].digest, full[i].digest, 32) == 0) j++;
+
+        if (j - i > 1) {
+            for (k = i; k < j; k++) members[k - i] = full[k].record;
+            handle_set(idx, members, j - i, mode, stats);
+        }
+        i = j;
+    }
+
+    free(full);
+}
+
+int find_dupes(const findex_t *idx, dupes_mode_t mode)
+{
+    size_t count = findex_count(idx);
+
+    // First-level filter: sizes that occur more than once. Empty files are not duplicates
+    // worth reporting.
+    int64_t *sizes = malloc((count ? count : 1) * sizeof(int64_t));
+    if (!sizes) {
+        fprintf(stderr, "find_dupes: Failed to allocate size table\n");
+        return -1;
+    }
+
+    size_t nsizes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (idx->records[i].file_size > 0) sizes[nsizes++] = idx->records[i].file_size;
+    }
+    qsort(sizes, nsizes, sizeof(int64_t), compare_sizes);
+
+    size_t nshared = 0;
+    for (size_t i = 0; i < nsizes; ) {
+        size_t j = i + 1;
+        while (j < nsizes && sizes[j] == sizes[i]) j++;
+        if (j - i > 1) sizes[nshared++] = sizes[i];
+        i = j;
+    }
+
+    // Only files with a shared size are keyed and sorted by digest
+    size_t ncandidates = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (idx->records[i].file_size > 0 && size_is_shared(sizes, nshared, idx->records[i].file_size)) ncandidates++;
+    }
+
+    dupekey_t *keys = malloc((ncandidates ? ncandidates : 1) * sizeof(dupekey_t));
+    uint32_t *members = malloc((ncandidates ? ncandidates : 1) * sizeof(uint32_t));
+    if (!keys || !members) {
+        fprintf(stderr, "find_dupes: Failed to allocate candidate table\n");
+        free(sizes);
+        free(keys);
+        free(members);
+        return -1;
+    }
+
+    size_t k = 0;
+    for (size_t i = 0; i < count; i++) {
+        const findex_record_t *rec = &idx->records[i];
+        if (rec->file_size <= 0 || !size_is_shared(sizes, nshared, rec->file_size)) continue;
+
+        keys[k].file_size = rec->file_size;
+        memcpy(&keys[k].prefix, rec->digest, sizeof(keys[k].prefix));
+        keys[k].record = (uint32_t)i;
+        k++;
+    }
+    free(sizes);
+
+    qsort(keys, ncandidates, sizeof(dupekey_t), compare_keys);
+
+    dupestats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    for (size_t i = 0; i < ncandidates; ) {
+        size_t j = i + 1;
+        while (j < ncandidates && keys[j].file_size == keys[i].file_size && keys[j].prefix == keys[i].prefix) j++;
+
+        if (j - i > 1) {
+            for (size_t m = i; m < j; m++) members[m - i] = keys[m].record;
+            handle_run(idx, members, j - i, mode, &stats);
+        }
+        i = j;
+    }
+
+    free(keys);
+    free(members);
+
+    printf("\nFound %zu duplicate sets, %zu redundant files, %lld reclaimable bytes\n", stats.sets, stats.files, stats.reclaimable);
+    if (mode != DUPES_REPORT) {
+        printf("Linked %zu files, %zu skipped or failed\n", stats.linked, stats.failed);
+    }
+
+    return 0;
+}
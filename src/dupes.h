@@ -0,0 +1,15 @@
+#ifndef DUPES_H
+#define DUPES_H
+
+#include "findex.h"
+
+typedef enum { DUPES_REPORT, DUPES_HARDLINK, DUPES_REFLINK } dupes_mode_t;
+
+// Group the files of a snapshot by content, using size as a first-level filter so that only
+// files sharing a size are ever compared by digest, and report every set of duplicates with
+// the bytes that could be reclaimed. Nothing is rehashed. With DUPES_HARDLINK or
+// DUPES_REFLINK, every duplicate is replaced by a hardlink or reflink to the first file of its
+// set, provided both still match the snapshot.
+int find_dupes(const findex_t *idx, dupes_mode_t mode);
+
+#endif
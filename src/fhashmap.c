@@ -2,13 +2,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static unsigned int hash_string(const char* str) 
+unsigned int fhashmap_hash(const char* str) 
 {
     unsigned long hash = 5381;
     int c;
     while ((c = *str++))
         hash = ((hash << 5) + hash) + c; // hash * 33 + c
-    return hash % HMAP_MAX_ELEMS;
+    return (unsigned int)hash;
+}
+
+static inline fhashshard_t *shard_of(fhashmap_t *map, unsigned int hash)
+{
+    return &map->shards[hash % HMAP_SHARDS];
 }
 
 inline void fhashmap_init(fhashmap_t *map) {
@@ -16,9 +21,52 @@ inline void fhashmap_init(fhashmap_t *map) {
         fprintf(stderr, "fhashmap_init: Failed to access hashmap\n");
         return;
     }
-    memset(map->farray, 0, sizeof(map->farray));
+    map->nbuckets = HMAP_MAX_ELEMS;
+    map->farray = calloc(map->nbuckets, sizeof(fhashentry_t *));
+    if(!map->farray) {
+        fprintf(stderr, "fhashmap_init: Failed to allocate buckets\n");
+        map->nbuckets = 0;
+    }
+
+    for(int i = 0; i < HMAP_SHARDS; i++) {
+        arena_init(&map->shards[i].arena);
+        map->shards[i].len = 0;
+    }
 }
 
+static fhashentry_t *fhashmap_new_entry(arena_t *arena, const char *filename, const char *filehash, long long file_size, long long mtime)
+{
+    fhashentry_t *entry = arena_alloc(arena, sizeof(fhashentry_t));
+    if(!entry) return NULL;
+
+    entry->filename = arena_strdup(arena, filename);
+    entry->filehash = arena_strdup(arena, filehash);
+    if(!entry->filename || !entry->filehash) return NULL;
+
+    entry->file_size = file_size;
+    entry->mtime = mtime;
+    entry->next = NULL;
+    return entry;
+}
+
+// Caller must own the shard of the filename's bucket
+static void fhashmap_insert(fhashmap_t* map, unsigned int hash, const char *filename, const char *filehash, long long file_size, long long mtime)
+{
+    fhashshard_t *shard = shard_of(map, hash);
+
+    fhashentry_t *new = fhashmap_new_entry(&shard->arena, filename, filehash, file_size, mtime);
+    if(!new || !map->nbuckets)
+    {   
+        fprintf(stderr, "Failed to add %s to hashmap\n", filename);
+        return;
+    }
+
+    // Push onto the front of the chain so the shard is held for O(1) work
+    size_t bucket = hash & (map->nbuckets - 1);
+    new->next = map->farray[bucket];
+    map->farray[bucket] = new;
+    shard->len++;
+}
 
 void fhashmap_add(fhashmap_t* map, const char *filename, const char *filehash, long long file_size, long long mtime)
 {   
@@ -27,44 +75,17 @@ void fhashmap_add(fhashmap_t* map, const char *filename, const char *filehash, l
         return;
     }
 
-    unsigned int hash = hash_string(filename);
-    
-    fhashentry_t *entry = map->farray[hash];
-    if(entry == NULL)   {
-        entry = malloc(sizeof(fhashentry_t));
-        if(!entry) 
-        {   
-            fprintf(stderr, "Failed to add %s to hashmap\n", filename);
-            return;
-        }
-
-        entry->filename = strdup(filename);
-        entry->filehash = strdup(filehash);
-        entry->file_size = file_size;
-        entry->mtime = mtime;
-        entry->next = NULL;
+    fhashmap_insert(map, fhashmap_hash(filename), filename, filehash, file_size, mtime);
+}
 
-        map->farray[hash] = entry;
+void fhashmap_add_hashed(fhashmap_t* map, unsigned int hash, const char *filename, const char *filehash, long long file_size, long long mtime)
+{
+    if(!map) {
+        fprintf(stderr, "fhashmap_add_hashed: Failed to access hashmap\n");
+        return;
     }
-    else    {
-        fhashentry_t *curr = entry;
-        while(curr->next) curr = curr->next;
 
-        fhashentry_t *new = malloc(sizeof(fhashentry_t)); 
-        if(!new)
-        {   
-            fprintf(stderr, "Failed to add %s to hashmap\n", filename);
-            return;
-        }
-
-        new->filename = strdup(filename);
-        new->filehash = strdup(filehash);
-        new->file_size = file_size;
-        new->mtime = mtime;
-        new->next = NULL;
-
-        curr->next = new;
-    }
+    fhashmap_insert(map, hash, filename, filehash, file_size, mtime);
 }
 
 fhashentry_t* fhashmap_lookup(fhashmap_t* map, const char* filename)
@@ -74,9 +95,11 @@ fhashentry_t* fhashmap_lookup(fhashmap_t* map, const char* filename)
         return NULL;
     }
 
-    unsigned int hash = hash_string(filename);
+    if(!map->nbuckets) return NULL;
+
+    unsigned int hash = fhashmap_hash(filename);
 
-    fhashentry_t *entry = map->farray[hash];
+    fhashentry_t *entry = map->farray[hash & (map->nbuckets - 1)];
     if(!entry)   {
         return NULL;
     }
@@ -93,6 +116,51 @@ fhashentry_t* fhashmap_lookup(fhashmap_t* map, const char* filename)
     return NULL;
 }
 
+int fhashmap_reserve(fhashmap_t *map, size_t expected)
+{
+    if(!map) {
+        fprintf(stderr, "fhashmap_reserve: Failed to access hashmap\n");
+        return -1;
+    }
+
+    // One bucket per entry, rounded up to a power of two
+    size_t nbuckets = HMAP_MAX_ELEMS;
+    while(nbuckets < expected) nbuckets <<= 1;
+    if(nbuckets <= map->nbuckets) return 0;
+
+    fhashentry_t **farray = calloc(nbuckets, sizeof(fhashentry_t *));
+    if(!farray) {
+        fprintf(stderr, "fhashmap_reserve: Failed to allocate %zu buckets\n", nbuckets);
+        return -1;
+    }
+
+    // Relink existing entries; they stay where they are in the shard arenas
+    for(size_t i = 0; i < map->nbuckets; i++) {
+        fhashentry_t *curr = map->farray[i];
+        while(curr) {
+            fhashentry_t *next = curr->next;
+            size_t bucket = fhashmap_hash(curr->filename) & (nbuckets - 1);
+            curr->next = farray[bucket];
+            farray[bucket] = curr;
+            curr = next;
+        }
+    }
+
+    free(map->farray);
+    map->farray = farray;
+    map->nbuckets = nbuckets;
+    return 0;
+}
+
+size_t fhashmap_size(const fhashmap_t *map)
+{
+    size_t len = 0;
+    for(int i = 0; i < HMAP_SHARDS; i++) {
+        len += map->shards[i].len;
+    }
+    return len;
+}
+
 void fhashmap_print(fhashmap_t *map)    
 {   
     if(!map) {
@@ -100,7 +168,7 @@ void fhashmap_print(fhashmap_t *map)
         return;
     }
 
-    for(int i = 0; i < HMAP_MAX_ELEMS; i++) {
+    for(size_t i = 0; i < map->nbuckets; i++) {
 
         fhashentry_t *curr = map->farray[i];
     
@@ -113,15 +181,13 @@ void fhashmap_print(fhashmap_t *map)
 
 void fhashmap_free(fhashmap_t *map)
 {
-    for(int i = 0; i < HMAP_MAX_ELEMS; ++i) {
-        fhashentry_t *entry = map->farray[i];
-        while(entry) {
-            fhashentry_t *next = entry->next;
-            free((char *)entry->filename); // Cast to non-const if needed
-            free((char *)entry->filehash);
-            free(entry);
-            entry = next;
-        }
-        map->farray[i] = NULL;
+    // Entries and their strings all live in the shard arenas, so teardown is one call per shard
+    free(map->farray);
+    map->farray = NULL;
+    map->nbuckets = 0;
+
+    for(int i = 0; i < HMAP_SHARDS; i++) {
+        map->shards[i].len = 0;
+        arena_free(&map->shards[i].arena);
     }
 }
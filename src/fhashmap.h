@@ -2,9 +2,15 @@
 #define FHASHMAP_H
 
 #include <string.h>
+#include "arena.h"
 
 // Hash map of filename to file hash
-#define HMAP_MAX_ELEMS 4096
+#define HMAP_MAX_ELEMS 4096 // Default bucket count, fhashmap_reserve grows it
+#define HMAP_SHARDS 64  // Buckets are striped across shards, each with its own arena
+
+// Shard owning a filename with full hash h. Bucket counts are powers of two >= HMAP_SHARDS,
+// so this does not change when the map is resized
+#define FHASHMAP_SHARD_OF(h) ((h) % HMAP_SHARDS)
 
 struct fhash_entry  {
     char *filename;
@@ -16,16 +22,37 @@ struct fhash_entry  {
 
 typedef struct fhash_entry fhashentry_t;
 
+typedef struct {
+    arena_t arena; // Backing storage for entries, filenames and hashes in this shard
+    size_t len;
+} fhashshard_t;
+
 typedef struct
 {
-    fhashentry_t *farray[HMAP_MAX_ELEMS];
+    fhashentry_t **farray;
+    size_t nbuckets;
+    fhashshard_t shards[HMAP_SHARDS];
 
 } fhashmap_t;
 
+// Full (unreduced) hash of a filename, as used for bucket and shard selection
+unsigned int fhashmap_hash(const char *filename);
+
 void fhashmap_add(fhashmap_t* map, const char *filename, const char *filehash, long long file_size, long long mtime);
+
+// Unlocked insert with a precomputed fhashmap_hash, for callers that partition work by shard
+// so that no two threads ever write to the same shard
+void fhashmap_add_hashed(fhashmap_t* map, unsigned int hash, const char *filename, const char *filehash, long long file_size, long long mtime);
+
+// Lock-free; safe to call from many threads as long as nothing is inserting into map
 fhashentry_t* fhashmap_lookup(fhashmap_t* map, const char* filename);
+
+// Grow the bucket array to hold expected entries without long chains
+int fhashmap_reserve(fhashmap_t *map, size_t expected);
+size_t fhashmap_size(const fhashmap_t *map);
+
 void fhashmap_print(fhashmap_t *map);
 void fhashmap_init(fhashmap_t *map);
 void fhashmap_free(fhashmap_t *map);
 
-#endif
\ No newline at end of file
+#endif
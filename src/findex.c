@@ -0,0 +1,531 @@
+#include "findex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define FINDEX_KEYS_PER_BUCKET 4
+#define FINDEX_MAX_DISPLACEMENT (1u << 20)
+#define FINDEX_MAX_ATTEMPTS 8
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static uint64_t hash_path(const char *str, uint64_t seed)
+{
+    uint64_t hash = 14695981039346656037ULL ^ seed; // FNV-1a
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+    return mix64(hash);
+}
+
+static inline uint64_t bucket_of(uint64_t hash, uint64_t nbuckets)
+{
+    return (hash >> 32) % nbuckets;
+}
+
+static inline uint64_t slot_of(uint64_t hash, uint32_t displacement, uint64_t nslots)
+{
+    return mix64(hash + displacement * 0x9e3779b97f4a7c15ULL) % nslots;
+}
+
+static size_t findex_layout_size(uint64_t count, uint64_t nbuckets, uint64_t nslots, uint64_t strings_size)
+{
+    return sizeof(findex_header_t) + count * sizeof(findex_record_t)
+         + nbuckets * sizeof(uint32_t) + nslots * sizeof(uint32_t) + strings_size;
+}
+
+// Point the section pointers of idx into idx->base
+static void findex_attach(findex_t *idx)
+{
+    const findex_header_t *header = idx->base;
+    const char *p = (const char *)idx->base + sizeof(findex_header_t);
+
+    idx->header = header;
+    idx->records = (const findex_record_t *)p;
+    p += header->count * sizeof(findex_record_t);
+    idx->seeds = (const uint32_t *)p;
+    p += header->nbuckets * sizeof(uint32_t);
+    idx->slots = (const uint32_t *)p;
+    p += header->nslots * sizeof(uint32_t);
+    idx->strings = p;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int parse_hex_digest(const char *hex, uint8_t digest[32])
+{
+    for (int i = 0; i < 32; i++) {
+        int hi = hex_value(hex[i*2]);
+        if (hi < 0) return -1;
+        int lo = hex_value(hex[i*2 + 1]);
+        if (lo < 0) return -1;
+        digest[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return hex[64] == '\0' ? 0 : -1;
+}
+
+void findex_hex(const findex_record_t *rec, char out[65])
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 32; i++) {
+        out[i*2] = digits[rec->digest[i] >> 4];
+        out[i*2 + 1] = digits[rec->digest[i] & 0xf];
+    }
+    out[64] = '\0';
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const fhashentry_t *ea = *(const fhashentry_t *const *)a;
+    const fhashentry_t *eb = *(const fhashentry_t *const *)b;
+    return strcmp(ea->filename, eb->filename);
+}
+
+// Hash-and-displace: place the largest buckets first, searching for a displacement that
+// sends every key of the bucket to a free slot
+static int place_keys(const uint64_t *hashes, uint64_t count, uint64_t nbuckets, uint64_t nslots,
+                      uint32_t *seeds, uint32_t *slots)
+{
+    int status = -1;
+    size_t *bucket_start = calloc(nbuckets + 1, sizeof(size_t));
+    uint32_t *members = malloc((count ? count : 1) * sizeof(uint32_t));
+    uint32_t *bucket_order = malloc(nbuckets * sizeof(uint32_t));
+    size_t *size_start = NULL;
+
+    if (!bucket_start || !members || !bucket_order) goto cleanup;
+
+    // Counting sort of keys by bucket
+    for (uint64_t i = 0; i < count; i++) {
+        bucket_start[bucket_of(hashes[i], nbuckets) + 1]++;
+    }
+    size_t max_bucket = 0;
+    for (uint64_t b = 0; b < nbuckets; b++) {
+        if (bucket_start[b + 1] > max_bucket) max_bucket = bucket_start[b + 1];
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    {
+        size_t *fill = malloc(nbuckets * sizeof(size_t));
+        if (!fill) goto cleanup;
+        memcpy(fill, bucket_start, nbuckets * sizeof(size_t));
+        for (uint64_t i = 0; i < count; i++) {
+            members[fill[bucket_of(hashes[i], nbuckets)]++] = (uint32_t)i;
+        }
+        free(fill);
+    }
+
+    // Counting sort of buckets by descending size
+    size_start = calloc(max_bucket + 2, sizeof(size_t));
+    if (!size_start) goto cleanup;
+    for (uint64_t b = 0; b < nbuckets; b++) {
+        size_start[max_bucket - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (size_t s = 0; s <= max_bucket; s++) {
+        size_start[s + 1] += size_start[s];
+    }
+    for (uint64_t b = 0; b < nbuckets; b++) {
+        bucket_order[size_start[max_bucket - (bucket_start[b + 1] - bucket_start[b])]++] = (uint32_t)b;
+    }
+
+    for (uint64_t s = 0; s < nslots; s++) slots[s] = FINDEX_EMPTY_SLOT;
+    memset(seeds, 0, nbuckets * sizeof(uint32_t));
+
+    for (uint64_t o = 0; o < nbuckets; o++) {
+        uint32_t b = bucket_order[o];
+        size_t first = bucket_start[b], last = bucket_start[b + 1];
+        if (first == last) break; // Remaining buckets are empty
+
+        uint32_t d;
+        for (d = 0; d < FINDEX_MAX_DISPLACEMENT; d++) {
+            size_t placed = first;
+            while (placed < last) {
+                uint64_t s = slot_of(hashes[members[placed]], d, nslots);
+                if (slots[s] != FINDEX_EMPTY_SLOT) break;
+                slots[s] = members[placed++];
+            }
+            if (placed == last) break;
+
+            // Collision, undo this attempt
+            for (size_t k = first; k < placed; k++) {
+                slots[slot_of(hashes[members[k]], d, nslots)] = FINDEX_EMPTY_SLOT;
+            }
+        }
+        if (d == FINDEX_MAX_DISPLACEMENT) goto cleanup;
+        seeds[b] = d;
+    }
+
+    status = 0;
+
+cleanup:
+    free(bucket_start);
+    free(members);
+    free(bucket_order);
+    free(size_start);
+    return status;
+}
+
+int findex_build(findex_t *idx, fhashmap_t *map)
+{
+    if (!idx || !map) {
+        fprintf(stderr, "findex_build: Failed to access index or hashmap\n");
+        return -1;
+    }
+    memset(idx, 0, sizeof(*idx));
+
+    size_t capacity = fhashmap_size(map);
+    fhashentry_t **entries = malloc((capacity ? capacity : 1) * sizeof(fhashentry_t *));
+    if (!entries) {
+        fprintf(stderr, "findex_build: Failed to allocate entry list\n");
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < map->nbuckets && count < capacity; i++) {
+        for (fhashentry_t *curr = map->farray[i]; curr && count < capacity; curr = curr->next) {
+            entries[count++] = curr;
+        }
+    }
+
+    qsort(entries, count, sizeof(fhashentry_t *), compare_entries);
+
+    // Drop duplicate filenames and hashes that are not SHA-256 hex digests
+    size_t kept = 0;
+    uint64_t strings_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t digest[32];
+        if (kept && strcmp(entries[kept - 1]->filename, entries[i]->filename) == 0) continue;
+        if (parse_hex_digest(entries[i]->filehash, digest)) {
+            fprintf(stderr, "findex_build: Ignoring %s, malformed hash\n", entries[i]->filename);
+            continue;
+        }
+        entries[kept++] = entries[i];
+        strings_size += strlen(entries[i]->filename) + 1;
+    }
+    count = kept;
+
+    uint64_t nbuckets = count / FINDEX_KEYS_PER_BUCKET + 1;
+    uint64_t nslots = count + count / 8 + 1;
+
+    size_t size = findex_layout_size(count, nbuckets, nslots, strings_size);
+    idx->base = calloc(1, size);
+    uint64_t *hashes = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!idx->base || !hashes) {
+        fprintf(stderr, "findex_build: Failed to allocate index\n");
+        free(entries);
+        free(hashes);
+        findex_free(idx);
+        return -1;
+    }
+    idx->size = size;
+
+    findex_header_t *header = idx->base;
+    memcpy(header->magic, FINDEX_MAGIC, sizeof(header->magic));
+    header->version = FINDEX_VERSION;
+    header->byte_order = FINDEX_BYTE_ORDER;
+    header->count = count;
+    header->nbuckets = nbuckets;
+    header->nslots = nslots;
+    header->strings_size = strings_size;
+    header->source_size = -1;
+    header->source_mtime = -1;
+    findex_attach(idx);
+
+    findex_record_t *records = (findex_record_t *)idx->records;
+    char *strings = (char *)idx->strings;
+    uint64_t offset = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(entries[i]->filename) + 1;
+        memcpy(strings + offset, entries[i]->filename, len);
+
+        records[i].filename = offset;
+        records[i].file_size = entries[i]->file_size;
+        records[i].mtime = entries[i]->mtime;
+        parse_hex_digest(entries[i]->filehash, records[i].digest);
+        offset += len;
+    }
+    free(entries);
+
+    int status = -1;
+    for (int attempt = 0; attempt < FINDEX_MAX_ATTEMPTS && status; attempt++) {
+        header->seed = mix64(0x5eed + attempt);
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = hash_path(strings + records[i].filename, header->seed);
+        }
+        status = place_keys(hashes, count, nbuckets, nslots, (uint32_t *)idx->seeds, (uint32_t *)idx->slots);
+    }
+    free(hashes);
+
+    if (status) {
+        fprintf(stderr, "findex_build: Failed to construct perfect hash\n");
+        findex_free(idx);
+        return -1;
+    }
+
+    return 0;
+}
+
+const findex_record_t *findex_lookup(const findex_t *idx, const char *filename)
+{
+    if (!idx || !idx->header || !idx->header->count) return NULL;
+
+    const findex_header_t *header = idx->header;
+    uint64_t hash = hash_path(filename, header->seed);
+    uint32_t d = idx->seeds[bucket_of(hash, header->nbuckets)];
+    uint32_t r = idx->slots[slot_of(hash, d, header->nslots)];
+
+    if (r == FINDEX_EMPTY_SLOT || r >= header->count) return NULL;
+
+    const findex_record_t *rec = &idx->records[r];
+    const char *name = findex_filename(idx, rec);
+    if (!name || strcmp(name, filename) != 0) return NULL;
+
+    return rec;
+}
+
+size_t findex_count(const findex_t *idx)
+{
+    return (idx && idx->header) ? (size_t)idx->header->count : 0;
+}
+
+const char *findex_filename(const findex_t *idx, const findex_record_t *rec)
+{
+    if (rec->filename >= idx->header->strings_size) return NULL;
+    return idx->strings + rec->filename;
+}
+
+static int stat_source(const char *source, int64_t *size, int64_t *mtime)
+{
+    struct stat st;
+    if (!source || stat(source, &st) != 0) return -1;
+
+    *size = (int64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return 0;
+}
+
+int findex_write(const findex_t *idx, const char *outfile, const char *source)
+{
+    if (!idx || !idx->header) {
+        fprintf(stderr, "findex_write: Failed to access index\n");
+        return -1;
+    }
+
+    findex_header_t header = *idx->header;
+    if (stat_source(source, &header.source_size, &header.source_mtime)) {
+        header.source_size = -1;
+        header.source_mtime = -1;
+    }
+
+    FILE *fp = fopen(outfile, "wb");
+    if (!fp) {
+        fprintf(stderr, "findex_write: Failed to open %s\n", outfile);
+        return -1;
+    }
+
+    size_t body = idx->size - sizeof(findex_header_t);
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+          && fwrite((const char *)idx->base + sizeof(findex_header_t), 1, body, fp) == body;
+
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "findex_write: Failed to write %s\n", outfile);
+        remove(outfile);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int findex_validate(const findex_t *idx, const char *source)
+{
+    if (idx->size < sizeof(findex_header_t)) return -1;
+
+    const findex_header_t *header = idx->base;
+    if (memcmp(header->magic, FINDEX_MAGIC, sizeof(header->magic)) != 0) return -1;
+    if (header->version != FINDEX_VERSION || header->byte_order != FINDEX_BYTE_ORDER) return -1;
+    if (header->count >= FINDEX_EMPTY_SLOT || header->nbuckets == 0 || header->nslots <= header->count) return -1;
+    if (findex_layout_size(header->count, header->nbuckets, header->nslots, header->strings_size) != idx->size) return -1;
+
+    const char *strings = (const char *)idx->base + idx->size - header->strings_size;
+    if (header->strings_size && strings[header->strings_size - 1] != '\0') return -1;
+
+    // Records are read sequentially by diffs anyway, so checking every name offset is cheap
+    const findex_record_t *records = (const findex_record_t *)((const char *)idx->base + sizeof(findex_header_t));
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (records[i].filename >= header->strings_size) return -1;
+    }
+
+    if (source) {
+        int64_t size, mtime;
+        if (stat_source(source, &size, &mtime)) return -1;
+        if (size != header->source_size || mtime != header->source_mtime) return -1;
+    }
+
+    return 0;
+}
+
+int findex_map(findex_t *idx, const char *infile, const char *source)
+{
+    if (!idx) {
+        fprintf(stderr, "findex_map: Failed to access index\n");
+        return -1;
+    }
+    memset(idx, 0, sizeof(*idx));
+
+#ifdef _WIN32
+    // No mmap here; read the block in one go instead
+    FILE *fp = fopen(infile, "rb");
+    if (!fp) return -1;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (size <= 0 || !(idx->base = malloc((size_t)size))) {
+        fclose(fp);
+        return -1;
+    }
+    idx->size = (size_t)size;
+
+    if (fread(idx->base, 1, idx->size, fp) != idx->size) {
+        fclose(fp);
+        findex_free(idx);
+        return -1;
+    }
+    fclose(fp);
+#else
+    int fd = open(infile, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return -1;
+
+    idx->base = base;
+    idx->size = (size_t)st.st_size;
+    idx->mapped = 1;
+#endif
+
+    if (findex_validate(idx, source)) {
+        findex_free(idx);
+        return -1;
+    }
+
+    findex_attach(idx);
+    return 0;
+}
+
+void findex_free(findex_t *idx)
+{
+    if (!idx) return;
+
+#ifndef _WIN32
+    if (idx->mapped) {
+        munmap(idx->base, idx->size);
+    } else
+#endif
+    free(idx->base);
+
+    memset(idx, 0, sizeof(*idx));
+}
+
+static inline uint64_t digest_prefix(const uint8_t digest[32])
+{
+    uint64_t prefix;
+    memcpy(&prefix, digest, sizeof(prefix));
+    return prefix;
+}
+
+static int compare_digest_entries(const void *a, const void *b)
+{
+    const fdigest_entry_t *ea = a;
+    const fdigest_entry_t *eb = b;
+
+    if (ea->prefix != eb->prefix) return ea->prefix < eb->prefix ? -1 : 1;
+    if (ea->record != eb->record) return ea->record < eb->record ? -1 : 1;
+    return 0;
+}
+
+int fdigests_build(fdigests_t *digests, const findex_t *idx)
+{
+    if (!digests || !idx) {
+        fprintf(stderr, "fdigests_build: Failed to access digest index\n");
+        return -1;
+    }
+
+    size_t count = findex_count(idx);
+    digests->count = 0;
+    digests->entries = malloc((count ? count : 1) * sizeof(fdigest_entry_t));
+    if (!digests->entries) {
+        fprintf(stderr, "fdigests_build: Failed to allocate digest index\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        digests->entries[i].prefix = digest_prefix(idx->records[i].digest);
+        digests->entries[i].record = (uint32_t)i;
+    }
+    digests->count = count;
+
+    // Ties are broken by record index, so paths sharing a digest stay in path order
+    qsort(digests->entries, count, sizeof(fdigest_entry_t), compare_digest_entries);
+    return 0;
+}
+
+size_t fdigests_find(const fdigests_t *digests, const uint8_t digest[32], size_t *first)
+{
+    uint64_t prefix = digest_prefix(digest);
+
+    // Lower bound
+    size_t lo = 0, hi = digests->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (digests->entries[mid].prefix < prefix) lo = mid + 1;
+        else hi = mid;
+    }
+
+    size_t end = lo;
+    while (end < digests->count && digests->entries[end].prefix == prefix) end++;
+
+    *first = lo;
+    return end - lo;
+}
+
+void fdigests_free(fdigests_t *digests)
+{
+    if (!digests) return;
+
+    free(digests->entries);
+    digests->entries = NULL;
+    digests->count = 0;
+}
@@ -0,0 +1,89 @@
+#ifndef FINDEX_H
+#define FINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "fhashmap.h"
+
+// Frozen, read-only index of a snapshot. Records are sorted by filename and found through
+// a perfect hash (hash-and-displace), so a lookup is one seed read, one slot read and one
+// string compare. The whole index is a single position-independent block that can be
+// written to disk and mmapped back as is.
+#define FINDEX_MAGIC "USBDIDX1"
+#define FINDEX_VERSION 1
+#define FINDEX_BYTE_ORDER 0x01020304u
+#define FINDEX_EMPTY_SLOT UINT32_MAX
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t count;         // Number of records
+    uint64_t nbuckets;      // Displacement buckets of the perfect hash
+    uint64_t nslots;        // Slots of the perfect hash, slightly more than count
+    uint64_t seed;
+    uint64_t strings_size;
+    int64_t source_size;    // Size and mtime of the JSON snapshot the index was written alongside
+    int64_t source_mtime;
+} findex_header_t;
+
+typedef struct {
+    uint64_t filename;      // Offset into the string pool
+    int64_t file_size;
+    int64_t mtime;
+    uint8_t digest[32];     // Raw SHA-256
+} findex_record_t;
+
+typedef struct {
+    const findex_header_t *header;
+    const findex_record_t *records;
+    const uint32_t *seeds;  // Per bucket displacement
+    const uint32_t *slots;  // Per slot record index, or FINDEX_EMPTY_SLOT
+    const char *strings;
+    void *base;
+    size_t size;
+    int mapped;             // base is a file mapping rather than a heap block
+} findex_t;
+
+// Freeze the contents of map into idx. map is not modified and may be freed afterwards.
+int findex_build(findex_t *idx, fhashmap_t *map);
+
+// Lock-free and thread-safe. Returns NULL if filename is not in the index.
+const findex_record_t *findex_lookup(const findex_t *idx, const char *filename);
+
+size_t findex_count(const findex_t *idx);
+const char *findex_filename(const findex_t *idx, const findex_record_t *rec);
+
+// Hex encode a record's digest into out (64 chars plus NUL)
+void findex_hex(const findex_record_t *rec, char out[65]);
+
+// Write idx to outfile, stamped with the current size and mtime of source
+int findex_write(const findex_t *idx, const char *outfile, const char *source);
+
+// Map an index written by findex_write. Fails if it is malformed or if source has
+// changed since the index was written.
+int findex_map(findex_t *idx, const char *infile, const char *source);
+
+void findex_free(findex_t *idx);
+
+// Digest-to-records index over a findex: records sorted by content, so every path holding
+// the same content is adjacent. Entries are keyed by the first 8 bytes of the digest;
+// callers compare the full digest of the record they land on.
+typedef struct {
+    uint64_t prefix;
+    uint32_t record;        // Index into findex_t.records
+} fdigest_entry_t;
+
+typedef struct {
+    fdigest_entry_t *entries;
+    size_t count;
+} fdigests_t;
+
+int fdigests_build(fdigests_t *digests, const findex_t *idx);
+
+// Number of entries whose prefix matches digest, starting at *first
+size_t fdigests_find(const fdigests_t *digests, const uint8_t digest[32], size_t *first);
+
+void fdigests_free(fdigests_t *digests);
+
+#endif
@@ -0,0 +1,344 @@
+#ifdef __linux__
+#define _GNU_SOURCE // syncfs
+#endif
+
+#include "journal.h"
+#include "copy.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static int is_separator(char c)
+{
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+static size_t root_length(const char *root)
+{
+    size_t len = strlen(root);
+    while (len > 1 && is_separator(root[len - 1])) len--;
+    return len;
+}
+
+// Path of dst relative to the destination root
+static const char *relative_path(const char *root, size_t root_len, const char *dst)
+{
+    if (strncmp(dst, root, root_len) != 0 || !is_separator(dst[root_len])) return dst;
+
+    const char *rel = dst + root_len;
+    while (is_separator(*rel)) rel++;
+    return rel;
+}
+
+static const char *journal_relative(const journal_t *journal, const char *dst)
+{
+    return relative_path(journal->root, journal->root_len, dst);
+}
+
+static void journal_path(char *out, size_t size, const char *root, size_t root_len, const char *name)
+{
+    snprintf(out, size, "%.*s/%s", (int)root_len, root, name);
+}
+
+// Make everything written to the destination so far durable
+static int sync_destination(int root_fd)
+{
+#if defined(__linux__)
+    return syncfs(root_fd);
+#elif defined(_WIN32)
+    (void)root_fd;
+    return 0;
+#else
+    (void)root_fd;
+    sync();
+    return 0;
+#endif
+}
+
+// Identifies the current boot, empty where there is no such thing. A file renamed into
+// place during this boot is safe from a killed process: the kernel still holds its data and
+// writes it out. Only a crash or power cut, which means a new boot, can lose it.
+static void boot_id(char *out, size_t size)
+{
+    out[0] = '\0';
+#ifdef __linux__
+    FILE *fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!fp) return;
+    if (!fgets(out, (int)size, fp)) out[0] = '\0';
+    out[strcspn(out, "\n")] = '\0';
+    fclose(fp);
+#else
+    (void)size;
+#endif
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// A resume set is just a list of relative paths
+typedef journal_resume_t strlist_t;
+
+static int strlist_push(strlist_t *list, const char *str)
+{
+    if (list->len == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        char **paths = realloc(list->paths, new_capacity * sizeof(char *));
+        if (!paths) return -1;
+
+        list->paths = paths;
+        list->capacity = new_capacity;
+    }
+
+    list->paths[list->len] = strdup(str);
+    if (!list->paths[list->len]) return -1;
+    list->len++;
+    return 0;
+}
+
+static void strlist_free(strlist_t *list)
+{
+    for (size_t i = 0; i < list->len; i++) free(list->paths[i]);
+    free(list->paths);
+    list->paths = NULL;
+    list->len = list->capacity = 0;
+}
+
+size_t journal_recover(const char *root, journal_resume_t *resume, int discard, FILE *info)
+{
+    if (resume) memset(resume, 0, sizeof(*resume));
+
+    size_t root_len = root_length(root);
+
+    char path[PATH_MAX];
+    journal_path(path, sizeof(path), root, root_len, JOURNAL_FILE);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+
+    char current_boot[64], journal_boot[64] = "";
+    boot_id(current_boot, sizeof(current_boot));
+
+    strlist_t planned = { 0 }, done = { 0 }, copied = { 0 }, inplace = { 0 };
+    char line[PATH_MAX + 4];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '\0' || line[1] != ' ') continue;
+
+        if (line[0] == 'B') {
+            snprintf(journal_boot, sizeof(journal_boot), "%s", line + 2);
+            continue;
+        }
+
+        strlist_t *list = line[0] == 'P' ? &planned : line[0] == 'D' ? &done : line[0] == 'C' ? &copied :
+                          line[0] == 'W' ? &inplace : NULL;
+        if (list && strlist_push(list, line + 2) != 0) {
+            fprintf(stderr, "journal_recover: Failed to read %s\n", path);
+            break;
+        }
+    }
+    fclose(fp);
+
+    // Copies not synced yet still count if the machine has not restarted since
+    int same_boot = current_boot[0] && strcmp(current_boot, journal_boot) == 0;
+    for (size_t i = 0; same_boot && i < copied.len; i++) {
+        if (strlist_push(&done, copied.paths[i]) != 0) break;
+    }
+    strlist_free(&copied);
+
+    qsort(done.paths, done.len, sizeof(char *), compare_strings);
+    qsort(inplace.paths, inplace.len, sizeof(char *), compare_strings);
+
+    size_t unconfirmed = 0;
+    for (size_t i = 0; i < planned.len; i++) {
+        if (bsearch(&planned.paths[i], done.paths, done.len, sizeof(char *), compare_strings)) continue;
+
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%.*s/%s" JOURNAL_TMP_SUFFIX, (int)root_len, root, planned.paths[i]);
+        remove(tmp);
+        // A file patched in place may be left with a mix of old and new blocks
+        if (discard || bsearch(&planned.paths[i], inplace.paths, inplace.len, sizeof(char *), compare_strings)) {
+            snprintf(tmp, sizeof(tmp), "%.*s/%s", (int)root_len, root, planned.paths[i]);
+            remove(tmp);
+        }
+        unconfirmed++;
+    }
+
+    fprintf(info, "Previous copy to %s was interrupted: %zu of %zu files had not been finished\n",
+            root, unconfirmed, planned.len);
+
+    strlist_free(&planned);
+    strlist_free(&inplace);
+    if (resume) *resume = done;
+    else strlist_free(&done);
+
+    // The finished files are carried into the next journal by whoever resumes
+    remove(path);
+    return unconfirmed;
+}
+
+int journal_resumed(const journal_resume_t *resume, const char *root, const char *dst)
+{
+    if (!resume || !resume->len) return 0;
+
+    const char *rel = relative_path(root, root_length(root), dst);
+    return bsearch(&rel, resume->paths, resume->len, sizeof(char *), compare_strings) != NULL;
+}
+
+void journal_resume_free(journal_resume_t *resume)
+{
+    strlist_free(resume);
+}
+
+int journal_open(journal_t *journal, const char *root, size_t checkpoint)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->root = root;
+    journal->root_len = root_length(root);
+    journal->checkpoint = checkpoint;
+    journal->root_fd = -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s", (int)journal->root_len, root);
+    ensure_directory_exists(path);
+
+#ifndef _WIN32
+    journal->root_fd = open(path, O_RDONLY);
+    if (journal->root_fd < 0) {
+        fprintf(stderr, "journal_open: Failed to open %s\n", path);
+        return -1;
+    }
+#endif
+
+    journal_path(path, sizeof(path), root, journal->root_len, JOURNAL_FILE);
+    journal->fp = fopen(path, "w");
+    if (!journal->fp) {
+        fprintf(stderr, "journal_open: Failed to create %s\n", path);
+#ifndef _WIN32
+        close(journal->root_fd);
+#endif
+        return -1;
+    }
+
+    char boot[64];
+    boot_id(boot, sizeof(boot));
+    if (boot[0]) fprintf(journal->fp, "B %s\n", boot);
+
+    omp_init_lock(&journal->lock);
+    return 0;
+}
+
+int journal_plan(journal_t *journal, const char *dst)
+{
+    return fprintf(journal->fp, "P %s\n", journal_relative(journal, dst)) < 0 ? -1 : 0;
+}
+
+int journal_plan_inplace(journal_t *journal, const char *dst)
+{
+    return fprintf(journal->fp, "W %s\n", journal_relative(journal, dst)) < 0 ? -1 : 0;
+}
+
+int journal_carry(journal_t *journal, const char *dst)
+{
+    const char *rel = journal_relative(journal, dst);
+    return fprintf(journal->fp, "P %s\nD %s\n", rel, rel) < 0 ? -1 : 0;
+}
+
+int journal_begin(journal_t *journal)
+{
+    if (fflush(journal->fp) != 0 || sync_destination(journal->root_fd) != 0) {
+        fprintf(stderr, "journal_begin: Failed to write the copy journal\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int journal_sync_locked(journal_t *journal)
+{
+    if (sync_destination(journal->root_fd) != 0) {
+        fprintf(stderr, "journal_sync: Failed to sync %s\n", journal->root);
+        return -1;
+    }
+
+    for (size_t i = 0; i < journal->npending; i++) {
+        fprintf(journal->fp, "D %s\n", journal->pending[i]);
+        free(journal->pending[i]);
+    }
+    journal->npending = 0;
+
+    // The D lines themselves become durable with the next sync; until then the files they
+    // cover are merely copied again
+    return fflush(journal->fp) == 0 ? 0 : -1;
+}
+
+int journal_done(journal_t *journal, const char *dst)
+{
+    int status = 0;
+    omp_set_lock(&journal->lock);
+
+    if (journal->npending == journal->capacity) {
+        size_t new_capacity = journal->capacity ? journal->capacity * 2 : 64;
+        char **pending = realloc(journal->pending, new_capacity * sizeof(char *));
+        if (pending) {
+            journal->pending = pending;
+            journal->capacity = new_capacity;
+        }
+    }
+
+    char *rel = journal->npending < journal->capacity ? strdup(journal_relative(journal, dst)) : NULL;
+    if (rel) {
+        journal->pending[journal->npending++] = rel;
+    } else {
+        status = -1;
+    }
+
+    // Flushed right away, so a run that is killed can be resumed without any sync
+    if (fprintf(journal->fp, "C %s\n", journal_relative(journal, dst)) < 0 || fflush(journal->fp) != 0) status = -1;
+
+    if (journal->checkpoint && journal->npending >= journal->checkpoint) {
+        status = journal_sync_locked(journal);
+    }
+
+    omp_unset_lock(&journal->lock);
+    return status;
+}
+
+int journal_sync(journal_t *journal)
+{
+    omp_set_lock(&journal->lock);
+    int status = journal_sync_locked(journal);
+    omp_unset_lock(&journal->lock);
+    return status;
+}
+
+int journal_close(journal_t *journal)
+{
+    int status = journal_sync(journal);
+
+    for (size_t i = 0; i < journal->npending; i++) free(journal->pending[i]);
+    free(journal->pending);
+    fclose(journal->fp);
+
+    // Only a batch that made it to the final sync is finished
+    if (status == 0) {
+        char path[PATH_MAX];
+        journal_path(path, sizeof(path), journal->root, journal->root_len, JOURNAL_FILE);
+        remove(path);
+    }
+
+#ifndef _WIN32
+    close(journal->root_fd);
+#endif
+    omp_destroy_lock(&journal->lock);
+    return status;
+}
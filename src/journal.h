@@ -0,0 +1,85 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <omp.h>
+
+// Crash safety for the copy stage. Files are written under a temporary name and renamed
+// into place, and instead of fsyncing every file the whole destination filesystem is synced
+// once at the end, or every few files with checkpoints. A small journal at the root of the
+// destination lists the files of the batch:
+//
+//   B <id>     the boot the batch ran in (Linux)
+//   P <path>   planned, written and synced before any copy starts
+//   W <path>   planned to be patched in place rather than replaced, see journal_plan_inplace
+//   C <path>   copied, written as soon as the file is renamed into place
+//   D <path>   done, written only after a sync that covered the file
+//
+// so a run that finds a journal left behind knows the previous batch was interrupted, which
+// of its files can not be trusted, and which are already done and need not be copied again:
+// those with a D line, and those with a C line if the machine has not restarted since, as a
+// process that was merely killed loses nothing the kernel already has. Paths are relative to
+// the destination root.
+#define JOURNAL_FILE ".usbdiff.journal"
+#define JOURNAL_TMP_SUFFIX ".usbdiff-tmp"
+
+typedef struct {
+    FILE *fp;
+    const char *root;
+    size_t root_len;
+    int root_fd;            // Any descriptor on the destination filesystem, for syncfs
+    size_t checkpoint;      // Sync after this many completed files, 0 for only at the end
+    char **pending;         // Completed since the last sync, waiting for their D line
+    size_t npending;
+    size_t capacity;
+    omp_lock_t lock;
+} journal_t;
+
+// Files an interrupted batch finished, sorted
+typedef struct {
+    char **paths;
+    size_t len;
+    size_t capacity;
+} journal_resume_t;
+
+// Clean up after a batch that did not finish: remove the temporary files of every planned
+// file that was not finished, and report them. The finished files go to resume, which may be
+// NULL. With discard, unfinished files are removed as well: for destinations whose files are
+// never rewritten, where one that was renamed into place but never synced could otherwise
+// be trusted with partial content. Unfinished files that were being patched in place are
+// always removed. Returns the number of unfinished files, 0 if there was no journal.
+size_t journal_recover(const char *root, journal_resume_t *resume, int discard, FILE *info);
+
+// Whether dst was confirmed by the interrupted batch. The caller still has to check that
+// dst matches its source, which may have changed since.
+int journal_resumed(const journal_resume_t *resume, const char *root, const char *dst);
+
+void journal_resume_free(journal_resume_t *resume);
+
+int journal_open(journal_t *journal, const char *root, size_t checkpoint);
+
+// Record the batch. Call for every file, then journal_begin before copying anything.
+int journal_plan(journal_t *journal, const char *dst);
+
+// Record that the planned dst may be patched in place instead of renamed into place. There
+// is no old copy to fall back on then, so if the batch does not finish dst it is removed on
+// recovery rather than kept half patched. Call before journal_begin.
+int journal_plan_inplace(journal_t *journal, const char *dst);
+
+// Record a file an interrupted batch already finished as planned and done, so it stays
+// done if this batch is interrupted too. Call before journal_begin.
+int journal_carry(journal_t *journal, const char *dst);
+int journal_begin(journal_t *journal);
+
+// Thread-safe. dst has been renamed into place: it is marked copied now and done at the next
+// sync.
+int journal_done(journal_t *journal, const char *dst);
+
+// Sync the destination filesystem and mark every completed file done
+int journal_sync(journal_t *journal);
+
+// Final sync, then drop the journal: the batch is complete
+int journal_close(journal_t *journal);
+
+#endif
@@ -58,88 +58,111 @@ static int append_to_buffer(stream_buffer_t *sb, const char *data, size_t data_s
     return 1;
 }
 
-// Find the end of a complete JSON object in the buffer
+// Resumable scanner state, so bytes already scanned are not rescanned as more chunks arrive
+typedef struct {
+    size_t pos;         // Next byte to look at
+    int started;        // Seen the opening brace or bracket of the current object
+    int brace_count;
+    int bracket_count;
+    int in_string;
+    int escaped;
+} json_scan_t;
+
+static void reset_json_scan(json_scan_t *scan, size_t start_pos) {
+    memset(scan, 0, sizeof(*scan));
+    scan->pos = start_pos;
+}
+
+// Find the end of a complete JSON object in the buffer, continuing from where the last call stopped
 // Returns the position after the complete JSON object, or -1 if incomplete
-static ssize_t find_complete_json_object(const char *buffer, size_t buffer_size, size_t start_pos) {
-    if (start_pos >= buffer_size) return -1;
-    
-    int brace_count = 0;
-    int bracket_count = 0;
-    int in_string = 0;
-    int escaped = 0;
-    size_t i;
-    
-    // Skip whitespace to find start of JSON object
-    while (start_pos < buffer_size && 
-           (buffer[start_pos] == ' ' || buffer[start_pos] == '\t' || 
-            buffer[start_pos] == '\n' || buffer[start_pos] == '\r')) {
-        start_pos++;
-    }
-    
-    if (start_pos >= buffer_size) return -1;
-    
-    // Check if this looks like a JSON object or array
-    if (buffer[start_pos] != '{' && buffer[start_pos] != '[') {
-        return -1;
+static ssize_t find_complete_json_object(json_scan_t *scan, const char *buffer, size_t buffer_size) {
+    size_t i = scan->pos;
+
+    if (!scan->started) {
+        // Skip whitespace to find start of JSON object
+        while (i < buffer_size && 
+               (buffer[i] == ' ' || buffer[i] == '\t' || 
+                buffer[i] == '\n' || buffer[i] == '\r')) {
+            i++;
+        }
+        scan->pos = i;
+
+        if (i >= buffer_size) return -1;
+
+        // Check if this looks like a JSON object or array
+        if (buffer[i] != '{' && buffer[i] != '[') {
+            return -1;
+        }
+        scan->started = 1;
     }
     
-    for (i = start_pos; i < buffer_size; i++) {
+    for (; i < buffer_size; i++) {
         char c = buffer[i];
         
-        if (escaped) {
-            escaped = 0;
+        if (scan->escaped) {
+            scan->escaped = 0;
             continue;
         }
         
-        if (c == '\\' && in_string) {
-            escaped = 1;
+        if (c == '\\' && scan->in_string) {
+            scan->escaped = 1;
             continue;
         }
         
         if (c == '"') {
-            in_string = !in_string;
+            scan->in_string = !scan->in_string;
             continue;
         }
         
-        if (in_string) {
+        if (scan->in_string) {
             continue;
         }
         
         switch (c) {
             case '{':
-                brace_count++;
+                scan->brace_count++;
                 break;
             case '}':
-                brace_count--;
-                if (brace_count == 0 && bracket_count == 0) {
+                scan->brace_count--;
+                if (scan->brace_count == 0 && scan->bracket_count == 0) {
                     return i + 1; // Found complete object
                 }
                 break;
             case '[':
-                bracket_count++;
+                scan->bracket_count++;
                 break;
             case ']':
-                bracket_count--;
-                if (brace_count == 0 && bracket_count == 0) {
+                scan->bracket_count--;
+                if (scan->brace_count == 0 && scan->bracket_count == 0) {
                     return i + 1; // Found complete array
                 }
                 break;
         }
         
-        if (brace_count < 0 || bracket_count < 0) {
+        if (scan->brace_count < 0 || scan->bracket_count < 0) {
             return -1; // Malformed JSON
         }
     }
     
+    scan->pos = i;
     return -1; // Incomplete JSON object
 }
 
+// Merge source into target. Takes ownership of source and returns the merged object.
 static cJSON* merge_json_objects(cJSON *target, cJSON *source) {
     if (!target || !source) return target;
     
     if (!cJSON_IsObject(target) || !cJSON_IsObject(source)) {
+        cJSON_Delete(source);
         return target;
     }
+
+    // The common case is a snapshot that is a single object: adopt it instead of copying
+    // every entry, which would cost a linear key search per entry
+    if (!target->child) {
+        cJSON_Delete(target);
+        return source;
+    }
     
     cJSON *item = NULL;
     cJSON_ArrayForEach(item, source) {
@@ -151,6 +174,7 @@ static cJSON* merge_json_objects(cJSON *target, cJSON *source) {
         }
     }
     
+    cJSON_Delete(source);
     return target;
 }
 
@@ -160,7 +184,7 @@ cJSON* create_json(fhashmap_t *map) {
     cJSON *files = cJSON_CreateObject();
     if (!files) return NULL;
 
-    for (int i = 0; i < HMAP_MAX_ELEMS; i++) {
+    for (size_t i = 0; i < map->nbuckets; i++) {
         fhashentry_t *curr = map->farray[i];
         while (curr) {
             cJSON *entry = cJSON_CreateObject();
@@ -169,7 +193,7 @@ cJSON* create_json(fhashmap_t *map) {
                 return NULL;
             }
 
-            cJSON_AddStringToObject(entry, "hash", strdup(curr->filehash));
+            cJSON_AddStringToObject(entry, "hash", curr->filehash);
             cJSON_AddNumberToObject(entry, "size", (double)curr->file_size);
             cJSON_AddNumberToObject(entry, "mtime", (double)curr->mtime);
 
@@ -253,6 +277,8 @@ int parse_json_stream(fhashmap_t *map, const char *infile)
     size_t bytes_read;
     cJSON *merged_object = cJSON_CreateObject();
     int success = 1;
+    json_scan_t scan;
+    reset_json_scan(&scan, 0);
     
     if (!merged_object) {
         fprintf(stderr, "parse_json_stream: Failed to create merged JSON object\n");
@@ -273,34 +299,21 @@ int parse_json_stream(fhashmap_t *map, const char *infile)
         size_t processed_pos = 0;
         ssize_t complete_pos;
         
-        while ((complete_pos = find_complete_json_object(sb->buffer, sb->buffer_size, processed_pos)) > 0) {
-            // Extract the complete JSON object
+        while ((complete_pos = find_complete_json_object(&scan, sb->buffer, sb->buffer_size)) > 0) {
+            // Parse the complete JSON object in place
             size_t object_length = complete_pos - processed_pos;
-            char *json_str = malloc(object_length + 1);
-            if (!json_str) {
-                fprintf(stderr, "parse_json_stream: Failed to allocate memory for JSON string\n");
-                success = 0;
-                goto cleanup;
-            }
-            
-            memcpy(json_str, sb->buffer + processed_pos, object_length);
-            json_str[object_length] = '\0';
-            
-            // Parse the JSON object
-            cJSON *parsed_object = cJSON_Parse(json_str);
-            free(json_str);
+            cJSON *parsed_object = cJSON_ParseWithLength(sb->buffer + processed_pos, object_length);
             
+            processed_pos = complete_pos;
+            reset_json_scan(&scan, processed_pos);
+
             if (!parsed_object) {
                 fprintf(stderr, "parse_json_stream: Failed to parse JSON object: %s\n", cJSON_GetErrorPtr());
-                processed_pos = complete_pos; // Skip this object and continue
-                continue;
+                continue; // Skip this object and continue
             }
             
             // Merge with main object
-            merge_json_objects(merged_object, parsed_object);
-            cJSON_Delete(parsed_object);
-            
-            processed_pos = complete_pos;
+            merged_object = merge_json_objects(merged_object, parsed_object);
         }
         
         // Move unprocessed data to beginning of buffer
@@ -308,6 +321,7 @@ int parse_json_stream(fhashmap_t *map, const char *infile)
             size_t remaining = sb->buffer_size - processed_pos;
             memmove(sb->buffer, sb->buffer + processed_pos, remaining);
             sb->buffer_size = remaining;
+            scan.pos -= processed_pos;
         }
         
         // // Check if buffer is getting too large without finding complete objects
@@ -320,19 +334,12 @@ int parse_json_stream(fhashmap_t *map, const char *infile)
     
     // Process any remaining complete JSON objects in buffer
     if (success && sb->buffer_size > 0) {
-        ssize_t complete_pos = find_complete_json_object(sb->buffer, sb->buffer_size, 0);
+        reset_json_scan(&scan, 0);
+        ssize_t complete_pos = find_complete_json_object(&scan, sb->buffer, sb->buffer_size);
         if (complete_pos > 0) {
-            char *json_str = malloc(complete_pos + 1);
-            if (json_str) {
-                memcpy(json_str, sb->buffer, complete_pos);
-                json_str[complete_pos] = '\0';
-                
-                cJSON *parsed_object = cJSON_Parse(json_str);
-                if (parsed_object) {
-                    merge_json_objects(merged_object, parsed_object);
-                    cJSON_Delete(parsed_object);
-                }
-                free(json_str);
+            cJSON *parsed_object = cJSON_ParseWithLength(sb->buffer, complete_pos);
+            if (parsed_object) {
+                merged_object = merge_json_objects(merged_object, parsed_object);
             }
         } else if (sb->buffer_size > 0) {
             // Check if remaining data is just whitespace
@@ -351,6 +358,9 @@ int parse_json_stream(fhashmap_t *map, const char *infile)
     }
     
     if(success) {
+        // Size the map for the whole snapshot up front instead of chaining into the default buckets
+        fhashmap_reserve(map, (size_t)cJSON_GetArraySize(merged_object));
+
         // Pick apart cJSON object into fhashmap entries
         cJSON *elem = NULL;
         cJSON_ArrayForEach(elem, merged_object)    {
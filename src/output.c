@@ -0,0 +1,189 @@
+#include "output.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+#endif
+
+#define ANSI_RED    "\033[31m"
+#define ANSI_GREEN  "\033[32m"
+#define ANSI_YELLOW "\033[33m"
+#define ANSI_RESET  "\033[0m"
+
+int output_parse_format(const char *name, output_format_t *format)
+{
+    if (strcmp(name, "text") == 0) *format = FORMAT_TEXT;
+    else if (strcmp(name, "ndjson") == 0) *format = FORMAT_NDJSON;
+    else if (strcmp(name, "null") == 0) *format = FORMAT_NULL;
+    else return -1;
+    return 0;
+}
+
+// Color is only worth emitting when a person is reading; escape codes break pipes and files
+static int output_is_terminal(FILE *fp)
+{
+#ifdef _WIN32
+    if (!_isatty(_fileno(fp))) return 0;
+
+    // Escape codes go through the buffer with everything else, so the console has to
+    // interpret them rather than being switched with SetConsoleTextAttribute
+    HANDLE hConsole = (HANDLE)_get_osfhandle(_fileno(fp));
+    DWORD mode;
+    if (!GetConsoleMode(hConsole, &mode)) return 0;
+    return SetConsoleMode(hConsole, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
+#else
+    return isatty(fileno(fp));
+#endif
+}
+
+int output_init(output_t *out, FILE *fp, output_format_t format)
+{
+    out->fp = fp;
+    out->format = format;
+    out->color = format == FORMAT_TEXT && output_is_terminal(fp);
+    out->len = 0;
+    out->count = 0;
+
+    out->buf = malloc(OUTPUT_BUFFER_SIZE);
+    if (!out->buf) {
+        fprintf(stderr, "output_init: Failed to allocate output buffer\n");
+        return -1;
+    }
+    return 0;
+}
+
+int output_flush(output_t *out)
+{
+    if (out->len && fwrite(out->buf, 1, out->len, out->fp) != out->len) {
+        fprintf(stderr, "output_flush: Failed to write diff output\n");
+        out->len = 0;
+        return -1;
+    }
+    out->len = 0;
+    return fflush(out->fp) == 0 ? 0 : -1;
+}
+
+static int output_write(output_t *out, const char *data, size_t len)
+{
+    if (out->len + len > OUTPUT_BUFFER_SIZE) {
+        if (output_flush(out) != 0) return -1;
+
+        // Larger than the whole buffer: nothing to gain from copying it first
+        if (len > OUTPUT_BUFFER_SIZE) {
+            return fwrite(data, 1, len, out->fp) == len ? 0 : -1;
+        }
+    }
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return 0;
+}
+
+static int output_str(output_t *out, const char *str)
+{
+    return output_write(out, str, strlen(str));
+}
+
+// JSON string body: quotes, backslashes and control characters escaped, other bytes as is
+static int output_json_str(output_t *out, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = str;
+
+    for (const char *p = str; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+
+        if (output_write(out, run, p - run) != 0) return -1;
+        run = p + 1;
+
+        char esc[6] = { '\\', 0 };
+        size_t len = 2;
+        switch (c) {
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\t': esc[1] = 't'; break;
+            case '\r': esc[1] = 'r'; break;
+            default:
+                memcpy(esc + 1, "u00", 3);
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                len = 6;
+        }
+        if (output_write(out, esc, len) != 0) return -1;
+    }
+    return output_write(out, run, strlen(run));
+}
+
+static int output_text(output_t *out, const filediff_t *diff)
+{
+    const char *color = ANSI_GREEN;
+    const char *sign = "+\t";
+    if (diff->status == DELETED) {
+        color = ANSI_RED;
+        sign = "-\t";
+    } else if (diff->status == RENAMED) {
+        color = ANSI_YELLOW;
+        sign = ">\t";
+    }
+
+    if (out->count == 0 && output_str(out, "Diffs:\n") != 0) return -1;
+    if (out->color && output_str(out, color) != 0) return -1;
+    if (output_str(out, sign) != 0) return -1;
+    if (diff->status == RENAMED) {
+        if (output_str(out, diff->old_filename) != 0 || output_str(out, " -> ") != 0) return -1;
+    }
+    if (output_str(out, diff->filename) != 0) return -1;
+    if (out->color && output_str(out, ANSI_RESET) != 0) return -1;
+    return output_write(out, "\n", 1);
+}
+
+static int output_ndjson(output_t *out, const filediff_t *diff)
+{
+    static const char *statuses[] = { "added", "modified", "deleted", "renamed" };
+    char size[64];
+
+    if (output_str(out, "{\"status\":\"") != 0 || output_str(out, statuses[diff->status]) != 0) return -1;
+    if (output_str(out, "\",\"path\":\"") != 0 || output_json_str(out, diff->filename) != 0) return -1;
+    if (diff->status == RENAMED) {
+        if (output_str(out, "\",\"old_path\":\"") != 0 || output_json_str(out, diff->old_filename) != 0) return -1;
+    }
+
+    int len = snprintf(size, sizeof(size), "\",\"size\":%lld}\n", diff->file_size);
+    return output_write(out, size, len);
+}
+
+int output_diff(const filediff_t *diff, void *ctx)
+{
+    output_t *out = ctx;
+    int status = 0;
+
+    switch (out->format) {
+        case FORMAT_TEXT:
+            status = output_text(out, diff);
+            break;
+        case FORMAT_NDJSON:
+            status = output_ndjson(out, diff);
+            break;
+        case FORMAT_NULL:
+            // Only paths that exist now, so the list can be fed straight to a copy tool
+            if (diff->status != DELETED) status = output_write(out, diff->filename, strlen(diff->filename) + 1);
+            break;
+    }
+
+    out->count++;
+    return status;
+}
+
+void output_free(output_t *out)
+{
+    if (!out->buf) return;
+    output_flush(out);
+    free(out->buf);
+    out->buf = NULL;
+}
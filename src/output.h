@@ -0,0 +1,40 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdio.h>
+#include "usbdiff.h"
+
+// Diff entries are formatted into one large buffer and written out in OUTPUT_BUFFER_SIZE
+// chunks, so a long diff costs a handful of writes rather than a printf per field
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum {
+    FORMAT_TEXT,    // "+\tpath" lines under a "Diffs:" header, colored on a terminal
+    FORMAT_NDJSON,  // One JSON object per line: status, path, old_path (renames only), size
+    FORMAT_NULL     // NUL-terminated paths of added, modified and renamed files, for xargs -0
+} output_format_t;
+
+typedef struct {
+    FILE *fp;
+    output_format_t format;
+    int color;              // Text format only, set when fp is a terminal
+    char *buf;
+    size_t len;
+    size_t count;           // Entries written so far
+} output_t;
+
+// Parse a --format value. Returns -1 if name is not a known format.
+int output_parse_format(const char *name, output_format_t *format);
+
+int output_init(output_t *out, FILE *fp, output_format_t format);
+
+// diff_callback_t taking an output_t
+int output_diff(const filediff_t *diff, void *ctx);
+
+// Write out everything buffered so far. Call before printing anything else to fp.
+int output_flush(output_t *out);
+
+// Flushes, then releases the buffer
+void output_free(output_t *out);
+
+#endif
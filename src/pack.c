@@ -0,0 +1,427 @@
+#include "pack.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+// One tar header block. Written in the GNU flavour, so names longer than the 100 byte
+// field go in a preceding ././@LongLink entry, which GNU tar and bsdtar both read.
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tarheader_t;
+
+static const char zero_block[PACK_BLOCK];
+
+static long long padding(long long size)
+{
+    return (PACK_BLOCK - size % PACK_BLOCK) % PACK_BLOCK;
+}
+
+// Octal while the value fits in the field, GNU base-256 beyond that (files over 8GB)
+static void tar_number(char *field, size_t size, unsigned long long value)
+{
+    if (value < (1ULL << (3 * (size - 1)))) {
+        snprintf(field, size, "%0*llo", (int)(size - 1), value);
+        return;
+    }
+
+    memset(field, 0, size);
+    field[0] = (char)0x80;
+    for (size_t i = size - 1; i > 0 && value; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static unsigned long long tar_parse_number(const char *field, size_t size)
+{
+    unsigned long long value = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        for (size_t i = 1; i < size; i++) value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+
+    for (size_t i = 0; i < size && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static unsigned int tar_checksum(const tarheader_t *header)
+{
+    const unsigned char *bytes = (const unsigned char *)header;
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(tarheader_t); i++) {
+        int in_chksum = i >= offsetof(tarheader_t, chksum) && i < offsetof(tarheader_t, chksum) + sizeof(header->chksum);
+        sum += in_chksum ? ' ' : bytes[i];
+    }
+    return sum;
+}
+
+static void tar_header(tarheader_t *header, const char *name, char type, unsigned int mode, long long size, long long mtime)
+{
+    memset(header, 0, sizeof(*header));
+    strncpy(header->name, name, sizeof(header->name));
+    tar_number(header->mode, sizeof(header->mode), mode);
+    tar_number(header->uid, sizeof(header->uid), 0);
+    tar_number(header->gid, sizeof(header->gid), 0);
+    tar_number(header->size, sizeof(header->size), (unsigned long long)size);
+    tar_number(header->mtime, sizeof(header->mtime), (unsigned long long)(mtime > 0 ? mtime : 0));
+    header->typeflag = type;
+    memcpy(header->magic, "ustar ", sizeof(header->magic));
+    memcpy(header->version, " ", sizeof(header->version));
+
+    snprintf(header->chksum, sizeof(header->chksum) - 1, "%06o", tar_checksum(header));
+    header->chksum[7] = ' ';
+}
+
+int pack_open(pack_t *pack, const char *root, journal_t *journal)
+{
+    memset(pack, 0, sizeof(*pack));
+    pack->root = root;
+    pack->journal = journal;
+
+    time_t now = time(NULL);
+    strftime(pack->stem, sizeof(pack->stem), "usbdiff-%Y%m%d-%H%M%S", localtime(&now));
+
+    pack->buf = malloc(2 * (size_t)PACK_BUFFER_SIZE);
+    if (!pack->buf) {
+        fprintf(stderr, "pack_open: Failed to allocate pack buffers\n");
+        return -1;
+    }
+
+    ensure_directory_exists(root);
+    return 0;
+}
+
+static void pack_volume_path(pack_t *pack)
+{
+    if (pack->volume == 1) snprintf(pack->path, sizeof(pack->path), "%s/%s.tar", pack->root, pack->stem);
+    else snprintf(pack->path, sizeof(pack->path), "%s/%s-%d.tar", pack->root, pack->stem, pack->volume);
+}
+
+static int pack_open_volume(pack_t *pack)
+{
+    pack->volume++;
+
+    char base[sizeof(pack->stem)];
+    snprintf(base, sizeof(base), "%s", pack->stem);
+
+    // The temporary file is created exclusively. A run within the same second as an earlier
+    // one picks the stem <stem>_2, _3... instead of replacing its archives.
+    char tmp[sizeof(pack->path) + 16];
+    pack->fp = NULL;
+    for (int n = 1; !pack->fp && n < 1000; n++) {
+        if (pack->volume == 1 && n > 1) snprintf(pack->stem, sizeof(pack->stem), "%.56s_%d", base, n);
+        pack_volume_path(pack);
+        snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, pack->path);
+
+        struct stat st;
+        if (pack->volume == 1 && stat(pack->path, &st) == 0) continue;
+
+        pack->fp = fopen(tmp, "wbx");
+        if (!pack->fp && (errno != EEXIST || pack->volume > 1)) break;
+    }
+
+    if (!pack->fp) {
+        fprintf(stderr, "pack_add: Failed to create %s\n", tmp);
+        return -1;
+    }
+
+    // Everything reaches the device in PACK_BUFFER_SIZE writes
+    setvbuf(pack->fp, pack->buf, _IOFBF, PACK_BUFFER_SIZE);
+    pack->size = 0;
+
+    if (pack->journal) {
+        journal_plan(pack->journal, pack->path);
+        journal_begin(pack->journal);
+    }
+    return 0;
+}
+
+static int pack_close_volume(pack_t *pack)
+{
+    char tmp[sizeof(pack->path) + 16];
+    snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, pack->path);
+
+    // End of archive marker
+    int ok = fwrite(zero_block, 1, PACK_BLOCK, pack->fp) == PACK_BLOCK
+          && fwrite(zero_block, 1, PACK_BLOCK, pack->fp) == PACK_BLOCK;
+    if (fclose(pack->fp) != 0) ok = 0;
+    pack->fp = NULL;
+
+#ifdef _WIN32
+    if (ok) remove(pack->path);
+#endif
+    if (!ok || rename(tmp, pack->path) != 0) {
+        fprintf(stderr, "pack_close: Failed to write %s\n", pack->path);
+        remove(tmp);
+        return -1;
+    }
+
+    if (pack->journal) journal_done(pack->journal, pack->path);
+    return 0;
+}
+
+int pack_add(pack_t *pack, const char *src, const char *name, copystats_t *stats)
+{
+    FILE *in = fopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "Failed to open source file: %s\n", src);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fileno(in), &st) != 0) {
+        fclose(in);
+        return -1;
+    }
+
+    size_t name_len = strlen(name);
+    long long size = (long long)st.st_size;
+    long long entry = PACK_BLOCK + size + padding(size);
+    if (name_len > sizeof(((tarheader_t *)0)->name)) entry += 2 * PACK_BLOCK + name_len + 1 + padding(name_len + 1);
+
+    // Room for the end of archive marker too
+    if (entry + 2 * PACK_BLOCK > PACK_VOLUME_SIZE) {
+        fclose(in);
+        return PACK_TOO_LARGE;
+    }
+
+    if (pack->fp && pack->size + entry > PACK_VOLUME_SIZE && pack_close_volume(pack) != 0) {
+        fclose(in);
+        return -1;
+    }
+    if (!pack->fp && pack_open_volume(pack) != 0) {
+        fclose(in);
+        return -1;
+    }
+
+    tarheader_t header;
+    int ok = 1;
+    if (name_len > sizeof(header.name)) {
+        tar_header(&header, "././@LongLink", 'L', 0, name_len + 1, 0);
+        ok = fwrite(&header, 1, PACK_BLOCK, pack->fp) == PACK_BLOCK
+          && fwrite(name, 1, name_len + 1, pack->fp) == name_len + 1
+          && fwrite(zero_block, 1, padding(name_len + 1), pack->fp) == (size_t)padding(name_len + 1);
+    }
+
+    tar_header(&header, name, '0', st.st_mode & 07777, size, (long long)st.st_mtime);
+    ok = ok && fwrite(&header, 1, PACK_BLOCK, pack->fp) == PACK_BLOCK;
+
+    // The header promised size bytes: a file that shrank meanwhile is padded with zeros and
+    // one that grew is cut, so the archive stays readable either way
+    char *rdbuf = pack->buf + PACK_BUFFER_SIZE;
+    long long remaining = size;
+    int status = 0;
+    while (ok && remaining > 0) {
+        size_t want = remaining < PACK_BUFFER_SIZE ? (size_t)remaining : PACK_BUFFER_SIZE;
+        size_t n = fread(rdbuf, 1, want, in);
+        if (n < want) {
+            memset(rdbuf + n, 0, want - n);
+            status = -1;
+        }
+        ok = fwrite(rdbuf, 1, want, pack->fp) == want;
+        remaining -= want;
+    }
+    ok = ok && fwrite(zero_block, 1, padding(size), pack->fp) == (size_t)padding(size);
+    fclose(in);
+
+    if (!ok) {
+        fprintf(stderr, "pack_add: Failed to write to %s\n", pack->path);
+        return -1;
+    }
+
+    pack->size += entry;
+    if (status != 0) {
+        fprintf(stderr, "pack_add: %s changed while it was being packed\n", src);
+        return -1;
+    }
+
+    if (stats) {
+        stats->files++;
+        stats->bytes_copied += size;
+    }
+    return 0;
+}
+
+int pack_close(pack_t *pack)
+{
+    int status = 0;
+    if (pack->fp) status = pack_close_volume(pack);
+
+    free(pack->buf);
+    pack->buf = NULL;
+    return status == 0 ? pack->volume : -1;
+}
+
+// Only plain relative paths below the extraction directory are accepted
+static int safe_name(const char *name)
+{
+    if (name[0] == '\0' || name[0] == '/' || name[0] == '\\' || strchr(name, ':')) return 0;
+
+    for (const char *p = name; *p; ) {
+        size_t len = strcspn(p, "/\\");
+        if (len == 2 && p[0] == '.' && p[1] == '.') return 0;
+        p += len;
+        if (*p) p++;
+    }
+    return 1;
+}
+
+static int unpack_file(FILE *in, const char *dst, long long size, unsigned int mode, long long mtime, char *buf)
+{
+    char tmp[PATH_MAX + 16];
+    snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, dst);
+
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fprintf(stderr, "unpack: Failed to create %s\n", tmp);
+        return -1;
+    }
+
+    int ok = 1;
+    for (long long remaining = size; ok && remaining > 0; ) {
+        size_t want = remaining < PACK_BUFFER_SIZE ? (size_t)remaining : PACK_BUFFER_SIZE;
+        ok = fread(buf, 1, want, in) == want && fwrite(buf, 1, want, out) == want;
+        remaining -= want;
+    }
+
+#ifndef _WIN32
+    if (ok && fflush(out) == 0) {
+        struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+        fchmod(fileno(out), mode & 07777);
+        futimens(fileno(out), times);
+    }
+#else
+    (void)mode;
+    (void)mtime;
+#endif
+
+    if (fclose(out) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(dst);
+#endif
+    if (!ok || rename(tmp, dst) != 0) {
+        fprintf(stderr, "unpack: Failed to extract %s\n", dst);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int unpack(const char *archive, const char *dir, FILE *info)
+{
+    FILE *in = fopen(archive, "rb");
+    if (!in) {
+        fprintf(stderr, "unpack: Failed to open %s\n", archive);
+        return -1;
+    }
+
+    char *buf = malloc(PACK_BUFFER_SIZE);
+    if (!buf) {
+        fprintf(stderr, "unpack: Failed to allocate buffer\n");
+        fclose(in);
+        return -1;
+    }
+
+    dircache_t dirs;
+    dircache_init(&dirs, dir);
+
+    char long_name[PATH_MAX];
+    int have_long_name = 0;
+    size_t extracted = 0, failed = 0;
+    int status = 0;
+
+    tarheader_t header;
+    while (fread(&header, 1, PACK_BLOCK, in) == PACK_BLOCK) {
+        if (memcmp(&header, zero_block, PACK_BLOCK) == 0) break;
+
+        if (tar_parse_number(header.chksum, sizeof(header.chksum)) != tar_checksum(&header)) {
+            fprintf(stderr, "unpack: %s is damaged\n", archive);
+            status = -1;
+            break;
+        }
+
+        long long size = (long long)tar_parse_number(header.size, sizeof(header.size));
+        long long skip = size + padding(size);
+
+        if (header.typeflag == 'L') {
+            size_t len = size < (long long)sizeof(long_name) ? (size_t)size : sizeof(long_name) - 1;
+            if (fread(long_name, 1, len, in) != len) break;
+            long_name[len] = '\0';
+            have_long_name = 1;
+            skip -= len;
+            if (skip && fseek(in, skip, SEEK_CUR) != 0) break;
+            continue;
+        }
+
+        char name[PATH_MAX];
+        if (have_long_name) {
+            snprintf(name, sizeof(name), "%s", long_name);
+        } else if (header.prefix[0] && memcmp(header.magic, "ustar", 6) == 0) {
+            snprintf(name, sizeof(name), "%.*s/%.*s", (int)sizeof(header.prefix), header.prefix, (int)sizeof(header.name), header.name);
+        } else {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(header.name), header.name);
+        }
+        have_long_name = 0;
+
+        char dst[PATH_MAX];
+        int fits = snprintf(dst, sizeof(dst), "%s/%s", dir, name) < (int)sizeof(dst);
+
+        if (!fits || !safe_name(name)) {
+            fprintf(stderr, "unpack: Refusing %s\n", name);
+        } else if (header.typeflag == '0' || header.typeflag == '\0') {
+            unsigned int mode = (unsigned int)tar_parse_number(header.mode, sizeof(header.mode));
+            long long mtime = (long long)tar_parse_number(header.mtime, sizeof(header.mtime));
+
+            if (dircache_ensure_parent(&dirs, dst) == 0 && unpack_file(in, dst, size, mode, mtime, buf) == 0) {
+                fprintf(info, "Unpacked: %s\n", name);
+                extracted++;
+            } else {
+                failed++;
+                status = -1;
+                break;
+            }
+            skip = padding(size);
+        } else if (header.typeflag == '5') {
+            ensure_directory_exists(dst);
+        } else {
+            fprintf(stderr, "unpack: Skipping %s\n", name);
+        }
+
+        if (skip && fseek(in, skip, SEEK_CUR) != 0) break;
+    }
+
+    fprintf(info, "Unpacked %zu files from %s\n", extracted, archive);
+    if (failed) fprintf(stderr, "unpack: Failed to extract %zu files\n", failed);
+
+    dircache_free(&dirs);
+    free(buf);
+    fclose(in);
+    return status;
+}
@@ -0,0 +1,41 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdio.h>
+#include "copy.h"
+
+// --pack: instead of one file per change, changed files are appended to tar archives at the
+// destination, written with large sequential writes. FAT32 and exFAT sticks are slow at
+// creating many small files but fast at streaming one big one. A run writes one archive,
+// rolling over to another volume before PACK_VOLUME_SIZE so every volume fits on FAT32.
+#define PACK_BUFFER_SIZE (4 << 20)
+#define PACK_VOLUME_SIZE (4000LL << 20)
+#define PACK_BLOCK 512
+#define PACK_TOO_LARGE 1    // pack_add: the file alone would not fit in a volume
+
+typedef struct {
+    const char *root;
+    char stem[64];          // usbdiff-<date>-<time>, shared by every volume of the run
+    int volume;
+    char path[4096];        // Current volume
+    FILE *fp;
+    long long size;         // Bytes written to the current volume
+    char *buf;
+    journal_t *journal;     // May be NULL
+} pack_t;
+
+int pack_open(pack_t *pack, const char *root, journal_t *journal);
+
+// Append src to the archive as name, a '/' separated relative path. Returns PACK_TOO_LARGE,
+// writing nothing, for a file that would not fit in a volume on its own; those are left to
+// the caller to copy as plain files.
+int pack_add(pack_t *pack, const char *src, const char *name, copystats_t *stats);
+
+// Finish the current volume. Returns the number of volumes written, or -1 on failure.
+int pack_close(pack_t *pack);
+
+// Extract a tar archive written by --pack (or any ustar or GNU tar of regular files) into
+// dir, keeping modes and timestamps. Entries that would land outside dir are refused.
+int unpack(const char *archive, const char *dir, FILE *info);
+
+#endif
@@ -0,0 +1,177 @@
+#include "store.h"
+#include "copy.h"
+#include "json_helper.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+void store_object_path(char *out, size_t size, const char *store, const findex_record_t *rec)
+{
+    char hex[65];
+    findex_hex(rec, hex);
+    snprintf(out, size, "%s/" STORE_OBJECTS "/%.2s/%s", store, hex, hex + 2);
+}
+
+// Entries are grouped by digest prefix only, so look back through the group for the full digest
+static int seen_before(const fdigests_t *digests, const findex_t *idx, size_t i)
+{
+    const uint8_t *digest = idx->records[digests->entries[i].record].digest;
+    for (size_t j = i; j > 0 && digests->entries[j - 1].prefix == digests->entries[i].prefix; j--) {
+        if (memcmp(idx->records[digests->entries[j - 1].record].digest, digest, 32) == 0) return 1;
+    }
+    return 0;
+}
+
+static int store_manifest(const char *store, fhashmap_t *map, FILE *info)
+{
+    cJSON *snapshot = create_json(map);
+    if (!snapshot) {
+        fprintf(stderr, "store_manifest: Failed to create cJSON object\n");
+        return -1;
+    }
+
+    char stem[64];
+    time_t now = time(NULL);
+    strftime(stem, sizeof(stem), "usbdiff-%Y%m%d-%H%M%S", localtime(&now));
+
+    char path[PATH_MAX], tmp[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s/" STORE_MANIFESTS, store);
+    ensure_directory_exists(path);
+
+    // Runs within the same second get _2, _3... rather than replacing each other's manifest
+    FILE *fp = NULL;
+    for (int n = 1; !fp && n < 1000; n++) {
+        if (n == 1) snprintf(path, sizeof(path), "%s/" STORE_MANIFESTS "/%s.json", store, stem);
+        else snprintf(path, sizeof(path), "%s/" STORE_MANIFESTS "/%s_%d.json", store, stem, n);
+        snprintf(tmp, sizeof(tmp), "%s" JOURNAL_TMP_SUFFIX, path);
+
+        struct stat st;
+        if (stat(path, &st) == 0) continue;
+
+        fp = fopen(tmp, "wx");
+        if (!fp && errno != EEXIST) break;
+    }
+
+    if (!fp) {
+        fprintf(stderr, "store_manifest: Failed to create %s\n", tmp);
+        cJSON_Delete(snapshot);
+        return -1;
+    }
+
+    print_json(fp, snapshot);
+    cJSON_Delete(snapshot);
+
+    int ok = fflush(fp) == 0;
+#ifndef _WIN32
+    if (ok) ok = fsync(fileno(fp)) == 0;
+#endif
+    if (fclose(fp) != 0) ok = 0;
+
+#ifdef _WIN32
+    if (ok) remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0) {
+        fprintf(stderr, "store_manifest: Failed to write %s\n", path);
+        remove(tmp);
+        return -1;
+    }
+
+    fprintf(info, "Manifest: %s\n", path);
+    return 0;
+}
+
+int store_snapshot(const findex_t *idx, fhashmap_t *map, const char *store, int njobs, size_t checkpoint, FILE *info)
+{
+    fdigests_t digests;
+    if (fdigests_build(&digests, idx) != 0) {
+        fprintf(stderr, "store_snapshot: Failed to index digests\n");
+        return -1;
+    }
+
+    copyjob_t *jobs = malloc(digests.count ? digests.count * sizeof(copyjob_t) : 1);
+    if (!jobs) {
+        fprintf(stderr, "store_snapshot: Failed to allocate copy jobs\n");
+        fdigests_free(&digests);
+        return -1;
+    }
+
+    // Objects are never rewritten, so one that may be incomplete has to go
+    journal_recover(store, NULL, 1, info);
+
+    arena_t paths;
+    arena_init(&paths);
+
+    size_t count = 0, present = 0, failed = 0;
+    long long bytes_present = 0;
+    for (size_t i = 0; i < digests.count; i++) {
+        const findex_record_t *rec = &idx->records[digests.entries[i].record];
+
+        char path[PATH_MAX];
+        store_object_path(path, sizeof(path), store, rec);
+
+        // Identical content earlier in this run, or from any earlier run. An object of the
+        // wrong size is damaged and copied again.
+        struct stat st;
+        if (seen_before(&digests, idx, i) || (stat(path, &st) == 0 && (long long)st.st_size == rec->file_size)) {
+            present++;
+            bytes_present += rec->file_size;
+            continue;
+        }
+
+        copyjob_t *job = &jobs[count];
+        memset(job, 0, sizeof(*job));
+        job->src = findex_filename(idx, rec);
+        job->dst = arena_strdup(&paths, path);
+        job->size = rec->file_size;
+        job->digest = rec->digest;
+        if (!job->dst) {
+            fprintf(stderr, "Failed to store %s\n", job->src);
+            failed++;
+            continue;
+        }
+        count++;
+    }
+
+    dircache_t dirs;
+    dircache_init(&dirs, store);
+
+    journal_t journal;
+    journal_t *journaled = NULL;
+    if (journal_open(&journal, store, checkpoint) == 0) {
+        journaled = &journal;
+        for (size_t i = 0; i < count; i++) journal_plan(journaled, jobs[i].dst);
+        journal_begin(journaled);
+    }
+
+    copystats_t stats = { 0 };
+    failed += copy_files(jobs, count, njobs, &dirs, journaled, &stats);
+
+    if (journaled && journal_close(journaled) != 0) {
+        fprintf(stderr, "Failed to sync %s, the objects may not be on disk yet\n", store);
+        failed++;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (jobs[i].status != 0) fprintf(stderr, "Failed to store %s\n", jobs[i].src);
+    }
+
+    fprintf(info, "Stored %zu new objects, %zu files (%lld bytes) were already in %s\n", stats.files, present, bytes_present, store);
+    copystats_print(&stats, info);
+
+    // Only a complete run gets a manifest
+    int status = failed ? -1 : store_manifest(store, map, info);
+    if (failed) fprintf(stderr, "No manifest written: %zu files could not be stored\n", failed);
+
+    dircache_free(&dirs);
+    arena_free(&paths);
+    free(jobs);
+    fdigests_free(&digests);
+    return status;
+}
@@ -0,0 +1,27 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdio.h>
+#include "findex.h"
+#include "fhashmap.h"
+
+// --store: a deduplicating backup destination. Every distinct content is kept once, named
+// after its SHA-256, and each run adds a manifest listing what the tree looked like:
+//
+//   <store>/objects/ab/cdef...                 content whose digest is abcdef...
+//   <store>/manifests/usbdiff-<date>-<time>.json   a snapshot in the .usbdiff.json format
+//
+// Content already in the store is never copied again, whether it was renamed, duplicated
+// or backed up from another machine. Manifests can be diffed with --compare.
+#define STORE_OBJECTS "objects"
+#define STORE_MANIFESTS "manifests"
+
+// Path of the object holding the content of rec
+void store_object_path(char *out, size_t size, const char *store, const findex_record_t *rec);
+
+// Copy every file of idx whose content is missing from the store on up to njobs threads,
+// then write map as the manifest of this run. Copies are checked against their digest and
+// synced before the manifest is written, so a manifest never names a missing object.
+int store_snapshot(const findex_t *idx, fhashmap_t *map, const char *store, int njobs, size_t checkpoint, FILE *info);
+
+#endif
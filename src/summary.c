@@ -0,0 +1,156 @@
+#include "summary.h"
+#include <stdlib.h>
+#include <string.h>
+
+static int is_separator(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+static int summary_open_dir(summary_t *summary, const char *path, size_t len, int depth)
+{
+    if (summary->len == summary->capacity) {
+        size_t new_capacity = summary->capacity ? summary->capacity * 2 : 64;
+        dirsummary_t *dirs = realloc(summary->dirs, new_capacity * sizeof(dirsummary_t));
+        if (!dirs) {
+            fprintf(stderr, "summary_add: Failed to grow directory summary\n");
+            return -1;
+        }
+
+        summary->dirs = dirs;
+        summary->capacity = new_capacity;
+    }
+
+    dirsummary_t *dir = &summary->dirs[summary->len];
+    memset(dir, 0, sizeof(*dir));
+
+    dir->path = malloc(len + 1);
+    if (!dir->path) {
+        fprintf(stderr, "summary_add: Failed to grow directory summary\n");
+        return -1;
+    }
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+    dir->depth = depth;
+
+    summary->open[depth] = summary->len++;
+    summary->open_depth = depth;
+    return 0;
+}
+
+int summary_init(summary_t *summary, const char *root, int max_depth)
+{
+    memset(summary, 0, sizeof(*summary));
+
+    summary->root = root;
+    summary->max_depth = max_depth < 0 ? 0 : max_depth > SUMMARY_MAX_DEPTH ? SUMMARY_MAX_DEPTH : max_depth;
+
+    // Level 0 is the root and stays open for the whole diff
+    return summary_open_dir(summary, "", 0, 0);
+}
+
+int summary_add(const filediff_t *diff, void *ctx)
+{
+    summary_t *summary = ctx;
+    const char *path = diff->filename;
+
+    if (summary->root) {
+        size_t root_len = strlen(summary->root);
+        if (strncmp(path, summary->root, root_len) == 0) {
+            path += root_len;
+            while (is_separator(*path)) path++;
+        }
+    }
+
+    // Walk the directory components of path, reusing the open directory at each level when it
+    // still matches and opening a new one otherwise
+    int depth = 0;
+    const char *component = path;
+    for (const char *p = path; *p && depth < summary->max_depth; p++) {
+        if (!is_separator(*p)) continue;
+
+        // Leading and doubled separators do not start a new level
+        int empty = p == component;
+        component = p + 1;
+        if (empty) continue;
+
+        depth++;
+        size_t len = p - path;
+
+        if (depth <= summary->open_depth) {
+            const dirsummary_t *open = &summary->dirs[summary->open[depth]];
+            if (strlen(open->path) == len && memcmp(open->path, path, len) == 0) continue;
+        }
+
+        if (summary_open_dir(summary, path, len, depth)) return -1;
+    }
+    summary->open_depth = depth;
+
+    for (int level = 0; level <= depth; level++) {
+        dirsummary_t *dir = &summary->dirs[summary->open[level]];
+
+        switch (diff->status) {
+            case ADDED:
+                dir->added++;
+                dir->bytes_written += diff->file_size;
+                break;
+            case MODIFIED:
+                dir->modified++;
+                dir->bytes_written += diff->file_size;
+                break;
+            case DELETED:
+                dir->deleted++;
+                dir->bytes_removed += diff->file_size;
+                break;
+            case RENAMED:
+                dir->renamed++;
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static void format_bytes(char *out, size_t size, long long bytes)
+{
+    static const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = (double)bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+
+    if (unit == 0) snprintf(out, size, "%lld B", bytes);
+    else snprintf(out, size, "%.1f %s", value, units[unit]);
+}
+
+void summary_print(const summary_t *summary, FILE *out)
+{
+    fprintf(out, "Summary:\n");
+    fprintf(out, "%8s %8s %8s %8s %11s %11s  %s\n", "added", "modified", "deleted", "renamed", "written", "removed", "directory");
+
+    for (size_t i = 0; i < summary->len; i++) {
+        const dirsummary_t *dir = &summary->dirs[i];
+
+        char written[32], removed[32];
+        format_bytes(written, sizeof(written), dir->bytes_written);
+        format_bytes(removed, sizeof(removed), dir->bytes_removed);
+
+        const char *name = dir->depth == 0 ? (summary->root ? summary->root : ".") : dir->path;
+
+        fprintf(out, "%8zu %8zu %8zu %8zu %11s %11s  %*s%s\n",
+                dir->added, dir->modified, dir->deleted, dir->renamed, written, removed,
+                dir->depth * 2, "", name);
+    }
+}
+
+void summary_free(summary_t *summary)
+{
+    for (size_t i = 0; i < summary->len; i++) {
+        free(summary->dirs[i].path);
+    }
+    free(summary->dirs);
+    memset(summary, 0, sizeof(*summary));
+}
@@ -0,0 +1,42 @@
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#include <stdio.h>
+#include "usbdiff.h"
+
+// Per-directory roll-up of a diff, built in the same pass as the diff itself
+#define SUMMARY_MAX_DEPTH 64
+
+typedef struct {
+    char *path;             // Relative to the summary root, "" for the root itself
+    int depth;
+    size_t added;
+    size_t modified;
+    size_t deleted;
+    size_t renamed;
+    long long bytes_written;  // Size of added and modified files
+    long long bytes_removed;  // Last known size of deleted files
+} dirsummary_t;
+
+typedef struct {
+    const char *root;
+    int max_depth;
+    dirsummary_t *dirs;     // In tree order: every directory comes right before its subdirectories
+    size_t len;
+    size_t capacity;
+    size_t open[SUMMARY_MAX_DEPTH + 1]; // Directory currently being filled at each level
+    int open_depth;
+} summary_t;
+
+// Changes are counted towards their directory and every ancestor, down to max_depth levels
+// below root. root is stripped from the start of every path and may be NULL.
+int summary_init(summary_t *summary, const char *root, int max_depth);
+
+// diff_callback_t taking a summary_t. Relies on map_diff reporting changes in path order,
+// in which every directory's changes are contiguous, so no lookup table is needed.
+int summary_add(const filediff_t *diff, void *ctx);
+
+void summary_print(const summary_t *summary, FILE *out);
+void summary_free(summary_t *summary);
+
+#endif
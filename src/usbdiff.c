@@ -1,10 +1,21 @@
 #include "fhashmap.h"
+#include "findex.h"
+#include "diff.h"
+#include "summary.h"
+#include "dupes.h"
+#include "output.h"
+#include "copy.h"
+#include "delta.h"
+#include "pack.h"
+#include "compress.h"
+#include "store.h"
 #include <stdio.h>
 #include "usbdiff.h"
 #include "json_helper.h"
 #include "sha-256.h"
 #include <omp.h>
 #include <stdlib.h>
+#include <errno.h>
 
 int list_add(filelist_t *list, const char *path, long long size, long long mtime) 
 {   
@@ -134,295 +145,929 @@ void collect_files_list(const char *dir, filelist_t *list)
 #endif
 }
 
-int load_files(const filelist_t *const list, fhashmap_t *curr_map, fhashmap_t *prev_map)
-{   
-    if(!list || !curr_map || !prev_map) return -1;
+const char *make_relative_path(const char *full_path, const char *base_path) 
+{
+    size_t base_len = strlen(base_path);
     
-    #pragma omp parallel for schedule(dynamic, 8)
-    for(int i = 0; i < list->len; i++)  {
-        file_t *file = &list->files[i];
+    // Ensure base_path ends with separator for proper comparison
+    char normalized_base[PATH_MAX];
+    snprintf(normalized_base, sizeof(normalized_base), "%s", base_path);
+    
+    // Add trailing separator if not present
+    if (base_len > 0 && normalized_base[base_len-1] != '/' && normalized_base[base_len-1] != '\\') {
+#ifdef _WIN32
+        strncat(normalized_base, "\\", PATH_MAX - base_len - 1);
+#else
+        strncat(normalized_base, "/", PATH_MAX - base_len - 1);
+#endif
+        base_len++;
+    }
+    
+#ifdef _WIN32
+    // Case-insensitive match on Windows
+    if (_strnicmp(full_path, normalized_base, base_len) == 0) {
+#else
+    if (strncmp(full_path, normalized_base, base_len) == 0) {
+#endif
+        return full_path + base_len;
+    }
+    
+    // If no match, try without the trailing separator
+    base_len = strlen(base_path);
+#ifdef _WIN32
+    if (_strnicmp(full_path, base_path, base_len) == 0) {
+#else
+    if (strncmp(full_path, base_path, base_len) == 0) {
+#endif
+        const char *rel = full_path + base_len;
+        if (*rel == '\\' || *rel == '/') rel++;
+        return rel;
+    }
+    
+    return full_path; // fallback
+}
 
-        const char *filename = file->filename;
-        long long file_size = file->file_size;
-        long long mtime = file->mtime;
+// One hashed file, as produced by a hashing thread before it reaches the map
+typedef struct {
+    const char *filename; // Points into the file list
+    char filehash[65];
+    long long file_size;
+    long long mtime;
+    unsigned int hash; // fhashmap_hash(filename)
+} fileresult_t;
+
+typedef struct {
+    fileresult_t *items;
+    size_t len;
+    size_t capacity;
+} resultbuf_t;
+
+static int resultbuf_push(resultbuf_t *buf, const fileresult_t *result)
+{
+    if(buf->len == buf->capacity) {
+        size_t new_capacity = buf->capacity ? buf->capacity * 2 : 64;
+        fileresult_t *items = realloc(buf->items, new_capacity * sizeof(fileresult_t));
+        if(!items) return -1;
 
-        int reuse_hash = 0;
+        buf->items = items;
+        buf->capacity = new_capacity;
+    }
+
+    buf->items[buf->len++] = *result;
+    return 0;
+}
 
-        #pragma omp critical
-        {
-            fhashentry_t *entry = fhashmap_lookup(prev_map, filename);
+// Changed files that were copied while they were being hashed, see --read-once
+typedef struct {
+    const char *directory;
+    const char *copy_to_dir;
+    dircache_t *dirs;
+    const char **copied;    // Source paths, sorted once load_files is done
+    size_t len;
+    size_t capacity;
+    copystats_t stats;
+} readonce_t;
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int readonce_contains(const readonce_t *readonce, const char *filename)
+{
+    return readonce && bsearch(&filename, readonce->copied, readonce->len, sizeof(const char *), compare_paths) != NULL;
+}
+
+// Hash a file whose metadata changed while copying it to a temporary name at the destination.
+// The copy is moved into place if the content really changed and discarded if only the
+// metadata did, so the file is read once either way.
+static int hash_and_copy(readonce_t *readonce, const findex_record_t *entry, fileresult_t *result)
+{
+    char dst_path[PATH_MAX], tmp_path[PATH_MAX];
+    snprintf(dst_path, sizeof(dst_path), "%s%c%s", readonce->copy_to_dir, PATH_SEP, make_relative_path(result->filename, readonce->directory));
+    if(snprintf(tmp_path, sizeof(tmp_path), "%s" JOURNAL_TMP_SUFFIX, dst_path) >= (int)sizeof(tmp_path)) return -1;
+
+    uint8_t digest[32];
+    copystats_t stats = { 0 };
+    if(dircache_ensure_parent(readonce->dirs, tmp_path) != 0) return -1;
+    if(copy_file_hashed(result->filename, tmp_path, digest, &stats) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+
+    for(int i = 0; i < 32; i++) {
+        sprintf(result->filehash + i*2, "%02x", digest[i]);
+    }
+
+    if(entry && memcmp(entry->digest, digest, sizeof(digest)) == 0) {
+        remove(tmp_path);
+        return 0;
+    }
+
+#ifdef _WIN32
+    remove(dst_path);
+#endif
+    // The digest is good either way; if the copy can't be kept the copy stage redoes it
+    if(rename(tmp_path, dst_path) != 0) {
+        remove(tmp_path);
+        return 0;
+    }
 
-            if (entry && file_size == entry->file_size && mtime == entry->mtime) {
-                fhashmap_add(curr_map, filename, strdup(entry->filehash), entry->file_size, entry->mtime);
-                reuse_hash = 1;
+    #pragma omp critical(readonce)
+    {
+        if(readonce->len == readonce->capacity) {
+            size_t new_capacity = readonce->capacity ? readonce->capacity * 2 : 64;
+            const char **copied = realloc(readonce->copied, new_capacity * sizeof(const char *));
+            if(copied) {
+                readonce->copied = copied;
+                readonce->capacity = new_capacity;
             }
         }
 
-        if (reuse_hash) continue;
+        if(readonce->len < readonce->capacity) {
+            readonce->copied[readonce->len++] = result->filename;
+            readonce->stats.files += stats.files;
+            readonce->stats.bytes_copied += stats.bytes_copied;
+        }
+    }
+    return 0;
+}
 
-        char *hash = compute_sha256(filename);
-        if(!hash) {
-            fprintf(stderr, "Couldn't hash %s, skipping\n", filename);
-            continue;
+int load_files(const filelist_t *const list, fhashmap_t *curr_map, const findex_t *prev_index, readonce_t *readonce)
+{   
+    if(!list || !curr_map || !prev_index) return -1;
+
+    int nthreads = omp_get_max_threads();
+
+    // One result buffer per (thread, shard). Each thread only touches its own row while
+    // hashing, and the buffer headers live on the thread's stack until it is done, so the
+    // hot loop shares no writable state at all.
+    resultbuf_t *results = calloc((size_t)nthreads * HMAP_SHARDS, sizeof(resultbuf_t));
+    if(!results) {
+        fprintf(stderr, "load_files: Failed to allocate result buffers\n");
+        return -1;
+    }
+    
+    #pragma omp parallel num_threads(nthreads)
+    {
+        resultbuf_t local[HMAP_SHARDS];
+        memset(local, 0, sizeof(local));
+
+        #pragma omp for schedule(dynamic, 8)
+        for(int i = 0; i < list->len; i++)  {
+            const file_t *file = &list->files[i];
+
+            fileresult_t result;
+            result.filename = file->filename;
+            result.file_size = file->file_size;
+            result.mtime = file->mtime;
+            result.hash = fhashmap_hash(file->filename);
+
+            // The previous snapshot is frozen, so it is read without locking
+            const findex_record_t *entry = findex_lookup(prev_index, result.filename);
+
+            if (entry && result.file_size == entry->file_size && result.mtime == entry->mtime) {
+                findex_hex(entry, result.filehash);
+            }
+            // Only files changed in place are fused: a new path may be a rename, which the
+            // copy stage moves at the destination rather than copying again
+            else if (!readonce || !entry || hash_and_copy(readonce, entry, &result) != 0) {
+                char *hash = compute_sha256(result.filename);
+                if(!hash) {
+                    fprintf(stderr, "Couldn't hash %s, skipping\n", result.filename);
+                    continue;
+                }
+
+                snprintf(result.filehash, sizeof(result.filehash), "%s", hash);
+                free(hash);
+            }
+
+            if(resultbuf_push(&local[FHASHMAP_SHARD_OF(result.hash)], &result)) {
+                fprintf(stderr, "Failed to record %s, skipping\n", result.filename);
+            }
         }
-        
-        #pragma omp critical
-        fhashmap_add(curr_map, filename, strdup(hash), file_size, mtime);
 
-        free(hash);
+        memcpy(&results[(size_t)omp_get_thread_num() * HMAP_SHARDS], local, sizeof(local));
+    }
+
+    size_t total = 0;
+    for(size_t i = 0; i < (size_t)nthreads * HMAP_SHARDS; i++) {
+        total += results[i].len;
+    }
+
+    // Build the map in one pass with exact capacity. Each shard is filled by exactly one
+    // thread, so inserts need no locking.
+    fhashmap_reserve(curr_map, fhashmap_size(curr_map) + total);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int shard = 0; shard < HMAP_SHARDS; shard++) {
+        for(int t = 0; t < nthreads; t++) {
+            resultbuf_t *buf = &results[(size_t)t * HMAP_SHARDS + shard];
+
+            for(size_t j = 0; j < buf->len; j++) {
+                fileresult_t *result = &buf->items[j];
+                fhashmap_add_hashed(curr_map, result->hash, result->filename, result->filehash, result->file_size, result->mtime);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < (size_t)nthreads * HMAP_SHARDS; i++) {
+        free(results[i].items);
+    }
+    free(results);
+
+    if(readonce) {
+        qsort(readonce->copied, readonce->len, sizeof(const char *), compare_paths);
     }
 
     return 0;
 }
 
-size_t map_diff(filediff_t *diff, fhashmap_t *curr_map, fhashmap_t *prev_map)
+typedef struct {
+    size_t count;
+    difflist_t *copy_list; // Modified and renamed files to copy once the diff is done, NULL if not copying
+    int mirror;            // Deleted files go to copy_list as well
+    summary_t *summary;    // Roll changes up per directory instead of printing them, NULL if not summarising
+    output_t *output;
+} diffrun_t;
+
+// Print or summarise each change as soon as map_diff finds it
+static int on_diff(const filediff_t *diff, void *ctx)
 {
-    int diff_count = 0;
+    diffrun_t *run = ctx;
 
-    for(int i = 0; i < HMAP_MAX_ELEMS; i++) {
-        fhashentry_t *prev_map_entry = prev_map->farray[i];
+    if (run->summary) {
+        run->count++;
+        if (summary_add(diff, run->summary)) return -1;
+    } else {
+        run->count++;
+        if (output_diff(diff, run->output)) return -1;
+    }
+
+    if (run->copy_list && (diff->status != DELETED || run->mirror)) {
+        return difflist_push(diff, run->copy_list);
+    }
+    return 0;
+}
 
-        while(prev_map_entry)    {
 
-            fhashentry_t *curr_entry = fhashmap_lookup(curr_map, prev_map_entry->filename);
+// Path of the frozen index kept next to a JSON snapshot: foo.json -> foo.idx
+static void snapshot_index_path(char *out, size_t size, const char *json_path)
+{
+    size_t len = strlen(json_path);
+    size_t ext = strlen(".json");
 
-            // File Unchanged
-            if (curr_entry && strcmp(prev_map_entry->filehash, curr_entry->filehash) == 0) {
-                prev_map_entry = prev_map_entry->next;
-                continue;
-            }
+    if (len >= ext && strcmp(json_path + len - ext, ".json") == 0) {
+        snprintf(out, size, "%.*s.idx", (int)(len - ext), json_path);
+    } else {
+        snprintf(out, size, "%s.idx", json_path);
+    }
+}
+
+// Map the frozen index of a snapshot if it is still in sync with the JSON, otherwise parse
+// the JSON and freeze it in memory. Nothing is written next to the snapshot.
+int load_snapshot(findex_t *idx, const char *json_path)
+{
+    char index_path[PATH_MAX];
+    snapshot_index_path(index_path, sizeof(index_path), json_path);
+
+    if(findex_map(idx, index_path, json_path) == 0) return 0;
+
+    fhashmap_t map;
+    fhashmap_init(&map);
+
+    if(!parse_json_stream(&map, json_path)) {
+        fhashmap_free(&map);
+        return -1;
+    }
+
+    int status = findex_build(idx, &map);
+    fhashmap_free(&map);
+    return status;
+}
+
+// Diff two saved snapshots without touching the filesystem they describe
+int compare_snapshots(const char *old_file, const char *new_file, int summary_depth, output_format_t format)
+{
+    // Keep stdout clean for the diff itself when it is meant for another program
+    FILE *info = format == FORMAT_TEXT ? stdout : stderr;
+    findex_t prev_index, curr_index;
+
+    if(load_snapshot(&prev_index, old_file) != 0) {
+        fprintf(stderr, "Failed to load snapshot %s\n", old_file);
+        return 1;
+    }
+
+    if(load_snapshot(&curr_index, new_file) != 0) {
+        fprintf(stderr, "Failed to load snapshot %s\n", new_file);
+        findex_free(&prev_index);
+        return 1;
+    }
+
+    fprintf(info, "Compared %zu files against %zu\n", findex_count(&curr_index), findex_count(&prev_index));
+
+    summary_t summary;
+    if(summary_depth >= 0 && summary_init(&summary, NULL, summary_depth) != 0) {
+        findex_free(&prev_index);
+        findex_free(&curr_index);
+        return 1;
+    }
+
+    output_t output;
+    if(output_init(&output, stdout, format) != 0) {
+        if(summary_depth >= 0) summary_free(&summary);
+        findex_free(&prev_index);
+        findex_free(&curr_index);
+        return 1;
+    }
+
+    renames_t renames;
+    int status = find_renames(&renames, &curr_index, &prev_index);
+    if(status == 0) {
+        diffrun_t run = { 0, NULL, 0, summary_depth >= 0 ? &summary : NULL, &output };
+        map_diff(&curr_index, &prev_index, &renames, on_diff, &run);
+        renames_free(&renames);
+        output_flush(&output);
+
+        if(run.count == 0) fprintf(info, "No changes between snapshots.\n");
+        else if(run.summary) summary_print(run.summary, stdout);
+    } else {
+        fprintf(stderr, "Failed to detect renamed files\n");
+    }
+
+    output_free(&output);
+    if(summary_depth >= 0) summary_free(&summary);
+    findex_free(&prev_index);
+    findex_free(&curr_index);
+    return status ? 1 : 0;
+}
+
+static int has_suffix(const char *str, const char *suffix)
+{
+    size_t len = strlen(str), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+// Queue a destination file for --mirror to remove. The compressed form of a copy stored
+// compressed goes to companions, as it is removed along with the file but not reported on
+// its own. Returns the number of paths queued to removals.
+static size_t queue_removal(const char **removals, const char **companions, size_t *ncompanions,
+                            arena_t *paths, const char *dst_path, int compressed)
+{
+    size_t n = 0;
+    char *path = arena_strdup(paths, dst_path);
+    if(path) removals[n++] = path;
+
+    if(compressed) {
+        char gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)];
+        snprintf(gz_path, sizeof(gz_path), "%s" COMPRESS_SUFFIX, dst_path);
+        path = arena_strdup(paths, gz_path);
+        if(path) companions[(*ncompanions)++] = path;
+    }
+    return n;
+}
+
+// A copy confirmed by an interrupted run is kept if it still has the size and modification
+// time of its source, which copy_metadata carries over. FAT only keeps times to 2 seconds.
+// With compressed set, dst may have been stored compressed.
+static int resume_matches(const char *src, const char *dst, int compressed)
+{
+    struct stat src_st, dst_st;
+    if(stat(src, &src_st) != 0) return 0;
+
+    long long src_mtime = (long long)src_st.st_mtime;
+    if(stat(dst, &dst_st) == 0) {
+        return dst_st.st_size == src_st.st_size && llabs((long long)dst_st.st_mtime - src_mtime) <= 2;
+    }
+
+    // A compressed copy only has the time to go by
+    char gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)];
+    snprintf(gz_path, sizeof(gz_path), "%s" COMPRESS_SUFFIX, dst);
+    return compressed && stat(gz_path, &dst_st) == 0 && llabs((long long)dst_st.st_mtime - src_mtime) <= 2;
+}
+
+// How the copy stage brings copy_to_dir up to date
+typedef struct {
+    const char *directory;
+    const char *copy_to_dir;
+    int jobs;                   // Copies in flight at once
+    int delta;                  // Patch large files block by block, see delta.h
+    int compress;               // zlib level, 0 to copy files as they are, see compress.h
+    int mirror;                 // Remove deleted files at the destination too
+    dircache_t *dirs;           // Directories already created under copy_to_dir
+    size_t checkpoint;          // Sync the destination every this many files, 0 for only at the end
+    const readonce_t *readonce; // Files already copied by hash_and_copy, NULL if none
+    const journal_resume_t *resume; // Files a previous, interrupted run already finished
+    const findex_t *tree;       // The source tree as of this run
+    FILE *info;
+} copyopts_t;
+
+// Whether the source has a file named like the compressed copy of src, whose backup then
+// owns that name at the destination
+static int compressed_name_taken(const copyopts_t *opts, const char *src)
+{
+    char gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)];
+    snprintf(gz_path, sizeof(gz_path), "%s" COMPRESS_SUFFIX, src);
+    return findex_lookup(opts->tree, gz_path) != NULL;
+}
+
+// Whether the copy of src, rel_path at the destination, may be stored compressed
+static int stored_compressed(const copyopts_t *opts, const complist_t *compressed, const char *src, const char *rel_path)
+{
+    return complist_contains(compressed, rel_path) && !compressed_name_taken(opts, src);
+}
+
+static int difflist_has(const difflist_t *list, const char *filename)
+{
+    for(size_t i = 0; i < list->len; i++) {
+        if(list->items[i].status != DELETED && strcmp(list->items[i].filename, filename) == 0) return 1;
+    }
+    return 0;
+}
+
+// Bring copy_to_dir up to date with the changes in copy_list. Renames are applied first, as
+// they only touch the destination, then everything else is copied on up to opts->jobs threads.
+// Files already copied by hash_and_copy are skipped. Deleted files, present with --mirror,
+// are removed last in one batch, so an interrupted run leaves extra files rather than
+// missing ones.
+static int copy_changes(const difflist_t *copy_list, const copyopts_t *opts)
+{
+    const char *directory = opts->directory;
+    const char *copy_to_dir = opts->copy_to_dir;
+    FILE *info = opts->info;
+
+    // A changed X.gz may take one more job for X, see below
+    copyjob_t *jobs = malloc(copy_list->len * 2 * sizeof(copyjob_t));
+    blockmap_t *maps = calloc(copy_list->len ? copy_list->len * 2 : 1, sizeof(blockmap_t));
+    const char **removals = malloc((copy_list->len ? copy_list->len : 1) * 3 * sizeof(const char *));
+    const char **companions = malloc((copy_list->len ? copy_list->len : 1) * sizeof(const char *));
+    const char **vacated = malloc((copy_list->len ? copy_list->len : 1) * sizeof(const char *));
+    const char **resumed = malloc((copy_list->len ? copy_list->len : 1) * sizeof(const char *));
+    if(copy_list->len && (!jobs || !maps || !removals || !companions || !vacated || !resumed)) {
+        fprintf(stderr, "copy_changes: Failed to allocate copy jobs\n");
+        free(jobs);
+        free(maps);
+        free(removals);
+        free(companions);
+        free(vacated);
+        free(resumed);
+        return -1;
+    }
+
+    blockstore_t store = { 0 };
+    if(opts->delta) blockstore_load(&store, copy_to_dir);
+
+    // Checked even without --compress, for copies an earlier run compressed
+    complist_t compressed;
+    complist_load(&compressed, copy_to_dir);
 
-            // File Modified or Deleted
-            if (diff_count < MAX_DIFFS) {
-                if (curr_entry) {
-                    diff[diff_count].status = MODIFIED;
-                } else {
-                    diff[diff_count].status = DELETED;
+    arena_t paths;
+    arena_init(&paths);
+
+    size_t count = 0, nremovals = 0, ncompanions = 0, nvacated = 0, nresumed = 0;
+    for(size_t i = 0; i < copy_list->len; i++) {
+        const filediff_t *diff = &copy_list->items[i];
+        const char *rel_path = make_relative_path(diff->filename, directory);
+        if(readonce_contains(opts->readonce, diff->filename)) continue;
+
+        char dst_path[PATH_MAX];
+        snprintf(dst_path, sizeof(dst_path), "%s%c%s", copy_to_dir, PATH_SEP, rel_path);
+
+        if(diff->status == DELETED) {
+            int stored = stored_compressed(opts, &compressed, diff->filename, rel_path);
+            nremovals += queue_removal(removals + nremovals, companions, &ncompanions, &paths, dst_path, stored);
+            if(stored) complist_remove(&compressed, rel_path);
+            continue;
+        }
+
+        // The source gained X.gz while X is stored compressed under that very name. The new
+        // X.gz takes the name, and X is copied again as is unless it is being copied anyway.
+        if(has_suffix(rel_path, COMPRESS_SUFFIX)) {
+            size_t suffix_len = strlen(COMPRESS_SUFFIX);
+            char stem[PATH_MAX], stem_rel[PATH_MAX], stem_dst[PATH_MAX];
+            snprintf(stem, sizeof(stem), "%.*s", (int)(strlen(diff->filename) - suffix_len), diff->filename);
+            snprintf(stem_rel, sizeof(stem_rel), "%.*s", (int)(strlen(rel_path) - suffix_len), rel_path);
+            snprintf(stem_dst, sizeof(stem_dst), "%.*s", (int)(strlen(dst_path) - suffix_len), dst_path);
+
+            if(complist_contains(&compressed, stem_rel)) {
+                complist_remove(&compressed, stem_rel);
+
+                const findex_record_t *rec = findex_lookup(opts->tree, stem);
+                if(rec && !difflist_has(copy_list, stem) && !readonce_contains(opts->readonce, stem)) {
+                    copyjob_t *job = &jobs[count];
+                    memset(job, 0, sizeof(*job));
+                    job->src = findex_filename(opts->tree, rec);
+                    job->dst = arena_strdup(&paths, stem_dst);
+                    job->size = rec->file_size;
+                    if(job->dst) count++;
+                    else fprintf(stderr, "Failed to copy %s to %s\n", stem, stem_dst);
                 }
+            }
+        }
+
+        // A renamed file that was backed up before is moved at the destination
+        if(diff->status == RENAMED) {
+            const char *old_rel_path = make_relative_path(diff->old_filename, directory);
+
+            char old_dst_path[PATH_MAX];
+            snprintf(old_dst_path, sizeof(old_dst_path), "%s%c%s", copy_to_dir, PATH_SEP, old_rel_path);
+
+            if(dircache_ensure_parent(opts->dirs, dst_path) == 0 && move_file(old_dst_path, dst_path) == 0) {
+                fprintf(info, "Moved: %s -> %s\n", old_rel_path, rel_path);
+                if(opts->mirror) vacated[nvacated++] = arena_strdup(&paths, old_dst_path);
+                continue;
+            }
 
-                strncpy(diff[diff_count].filename, prev_map_entry->filename, MAX_PATH - 1);
-                diff[diff_count].filename[MAX_PATH - 1] = '\0';
-                diff_count++;
+            // The old copy may have been stored compressed, by this run's settings or not
+            char old_gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)], gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)];
+            snprintf(old_gz_path, sizeof(old_gz_path), "%s" COMPRESS_SUFFIX, old_dst_path);
+            snprintf(gz_path, sizeof(gz_path), "%s" COMPRESS_SUFFIX, dst_path);
+            if(stored_compressed(opts, &compressed, diff->old_filename, old_rel_path) && !compressed_name_taken(opts, diff->filename)
+               && move_file(old_gz_path, gz_path) == 0) {
+                fprintf(info, "Moved: %s -> %s\n", old_rel_path, rel_path);
+                complist_remove(&compressed, old_rel_path);
+                complist_add(&compressed, rel_path);
+                if(opts->mirror) vacated[nvacated++] = arena_strdup(&paths, old_gz_path);
+                continue;
             }
 
-            prev_map_entry = prev_map_entry->next;
+            // Copied again below, so a mirror drops the old copy
+            if(opts->mirror) {
+                int stored = stored_compressed(opts, &compressed, diff->old_filename, old_rel_path);
+                nremovals += queue_removal(removals + nremovals, companions, &ncompanions, &paths, old_dst_path, stored);
+                if(stored) complist_remove(&compressed, old_rel_path);
+            }
         }
 
-        // New files created
-        fhashentry_t *curr_map_entry = curr_map->farray[i];
-        while(curr_map_entry)    {
+        if(journal_resumed(opts->resume, copy_to_dir, dst_path) && resume_matches(diff->filename, dst_path, stored_compressed(opts, &compressed, diff->filename, rel_path))) {
+            const char *path = arena_strdup(&paths, dst_path);
+            if(path) {
+                resumed[nresumed++] = path;
+                continue;
+            }
+        }
 
-            fhashentry_t *prev_entry = fhashmap_lookup(prev_map, curr_map_entry->filename);
+        copyjob_t *job = &jobs[count];
+        job->src = diff->filename;
+        job->dst = arena_strdup(&paths, dst_path);
+        job->size = diff->file_size;
+        job->prev = NULL;
+        job->map = NULL;
+        job->compress = compressed_name_taken(opts, diff->filename) ? 0 : opts->compress;
+        job->digest = NULL;
+        if(!job->dst) {
+            fprintf(stderr, "Failed to copy %s to %s\n", diff->filename, dst_path);
+            continue;
+        }
 
-            if (diff_count < MAX_DIFFS) {
-                if (!prev_entry) {
-                    diff[diff_count].status = MODIFIED;
-                    strncpy(diff[diff_count].filename, curr_map_entry->filename, MAX_PATH - 1);
-                    diff[diff_count].filename[MAX_PATH - 1] = '\0';
-                    diff_count++;
-                }
+        if(opts->delta && diff->file_size >= DELTA_MIN_SIZE) {
+            maps[count].path = _strdup(rel_path);
+            if(maps[count].path) {
+                job->prev = blockstore_find(&store, rel_path);
+                job->map = &maps[count];
             }
-
-            curr_map_entry = curr_map_entry->next;
         }
+        count++;
     }
 
-    if(diff_count == 0)  {
-        printf("No changes to directory.\n");
-        return 0;
+    // Record the batch before touching any file, so an interrupted run can be detected
+    journal_t journal;
+    journal_t *journaled = NULL;
+    int opened = journal_open(&journal, copy_to_dir, opts->checkpoint) == 0;
+
+    // Files that may end up compressed are listed before they are copied, so the list is
+    // synced with the journal and covers an interrupted run too
+    for(size_t i = 0; i < count; i++) {
+        if(jobs[i].compress) complist_add(&compressed, make_relative_path(jobs[i].src, directory));
     }
-    
-    return diff_count;
-}
+    complist_save(&compressed, copy_to_dir);
 
-void print_diff(filediff_t *diff, size_t diff_count) {
-#ifdef _WIN32
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO info;
-    if (!GetConsoleScreenBufferInfo(hConsole, &info)) return;
-    WORD default_attr = info.wAttributes;
-
-    printf("Diffs:\n");
-    for (size_t i = 0; i < diff_count; i++) {
-        if (diff[i].status == MODIFIED) {
-            SetConsoleTextAttribute(hConsole, FOREGROUND_GREEN);
-            printf("+\t");
-        } else if (diff[i].status == DELETED) {
-            SetConsoleTextAttribute(hConsole, FOREGROUND_RED);
-            printf("-\t");
+    if(opened) {
+        journaled = &journal;
+        for(size_t i = 0; i < nresumed; i++) {
+            journal_carry(journaled, resumed[i]);
+        }
+        for(size_t i = 0; i < count; i++) {
+            journal_plan(journaled, jobs[i].dst);
+            if(jobs[i].prev) journal_plan_inplace(journaled, jobs[i].dst);
         }
+        journal_begin(journaled);
+    }
+
+    copystats_t stats = { 0 };
+    size_t failed = copy_files(jobs, count, opts->jobs, opts->dirs, journaled, &stats);
 
-        printf("%s\n", diff[i].filename);
-        SetConsoleTextAttribute(hConsole, default_attr); // Reset to previous text attributes
+    // One sync for the whole batch instead of one per file
+    if(journaled && journal_close(journaled) != 0) {
+        fprintf(stderr, "Failed to sync %s, the copies may not be on disk yet\n", copy_to_dir);
+        failed++;
     }
 
-#else // Linux/macOS
-    printf("Diffs:\n");
-    for (size_t i = 0; i < diff_count; i++) {
-        if (diff[i].status == MODIFIED) {
-            printf(FOREGROUND_GREEN "+\t");
-            printf("%s\n" RESET_COLOR, diff[i].filename);
-        } else if (diff[i].status == DELETED) {
-            printf(FOREGROUND_RED "-\t");
-            printf("%s\n" RESET_COLOR, diff[i].filename);
+    if(opts->readonce) {
+        const readonce_t *readonce = opts->readonce;
+        for(size_t i = 0; i < readonce->len; i++) {
+            fprintf(info, "Copied: %s (read once)\n", make_relative_path(readonce->copied[i], directory));
         }
+        stats.files += readonce->stats.files;
+        stats.bytes_copied += readonce->stats.bytes_copied;
+    }
 
+    for(size_t i = 0; i < count; i++) {
+        if(jobs[i].status != 0) {
+            fprintf(stderr, "Failed to copy %s to %s\n", jobs[i].src, jobs[i].dst);
+        } else {
+            fprintf(info, "Copied: %s -> %s\n", make_relative_path(jobs[i].src, directory), jobs[i].dst);
+        }
     }
-#endif
-}
+    if(nresumed) fprintf(info, "Skipped %zu files already copied by the interrupted run\n", nresumed);
+    copystats_print(&stats, info);
 
-void ensure_directory_exists(const char *path) 
-{
-    char tmp[PATH_MAX];
-    snprintf(tmp, PATH_MAX, "%s", path);
+    // A file now copied as is drops the compressed copy of an earlier run
+    for(size_t i = 0; i < count + (opts->readonce ? opts->readonce->len : 0); i++) {
+        const char *src = i < count ? jobs[i].src : opts->readonce->copied[i - count];
+        if(i < count && (jobs[i].status != 0 || jobs[i].compressed)) continue;
 
-    for (char *p = tmp + 1; *p; p++) {
-        if (*p == '/' || *p == '\\') {
-            char c = *p;
-            *p = '\0';
+        const char *rel_path = make_relative_path(src, directory);
+        if(!stored_compressed(opts, &compressed, src, rel_path)) continue;
 
-#ifdef _WIN32
-            _mkdir(tmp); // Windows
-#else
-            mkdir(tmp, 0755); // POSIX
-#endif
-            *p = c;
+        char gz_path[PATH_MAX + sizeof(COMPRESS_SUFFIX)];
+        snprintf(gz_path, sizeof(gz_path), "%s%c%s" COMPRESS_SUFFIX, copy_to_dir, PATH_SEP, rel_path);
+        if(remove(gz_path) != 0 && errno != ENOENT) {
+            fprintf(stderr, "Failed to delete %s\n", gz_path);
+            continue;
         }
+        complist_remove(&compressed, rel_path);
     }
 
-#ifdef _WIN32
-    _mkdir(tmp);
-#else
-    mkdir(tmp, 0755);
-#endif
+    // Files moved away are already gone, they are only passed on so their old directories
+    // are pruned too
+    size_t ndeleted = nremovals;
+    for(size_t i = 0; i < ncompanions; i++) removals[nremovals++] = companions[i];
+    size_t nreported = nremovals;
+    for(size_t i = 0; i < nvacated; i++) {
+        if(vacated[i]) removals[nremovals++] = vacated[i];
+    }
+
+    if(nremovals) {
+        int *removed = malloc(nremovals * sizeof(int));
+        size_t not_removed = removed ? dircache_remove(opts->dirs, removals, nremovals, removed) : nremovals;
+        for(size_t i = 0; removed && i < nreported; i++) {
+            if(removed[i] != 0) fprintf(stderr, "Failed to delete %s\n", removals[i]);
+            else if(i < ndeleted) fprintf(info, "Deleted: %s\n", removals[i]);
+        }
+        if(!removed) fprintf(stderr, "copy_changes: Failed to allocate removal results\n");
+        failed += not_removed;
+        free(removed);
+    }
+
+    // Remember the new block digests for next time
+    if(opts->delta) {
+        for(size_t i = 0; i < count; i++) {
+            if(!jobs[i].map) continue;
+            if(jobs[i].status != 0 || blockstore_put(&store, jobs[i].map) != 0) blockmap_free(jobs[i].map);
+        }
+        blockstore_save(&store, copy_to_dir);
+        blockstore_free(&store);
+    }
+
+    complist_save(&compressed, copy_to_dir);
+    complist_free(&compressed);
+
+    arena_free(&paths);
+    free(removals);
+    free(companions);
+    free(vacated);
+    free(resumed);
+    free(maps);
+    free(jobs);
+    return failed ? -1 : 0;
 }
 
-int copy_file(const char *src, const char *dst) 
+// --pack: append every changed file, renames included, to tar volumes under copy_to_dir.
+// Files too large for a volume are copied as plain files instead.
+static int pack_changes(const difflist_t *copy_list, const copyopts_t *opts)
 {
-    FILE *in = fopen(src, "rb");
-    if (!in) {
-        fprintf(stderr, "Failed to open source file: %s\n", src);
+    const char *copy_to_dir = opts->copy_to_dir;
+    FILE *info = opts->info;
+
+    copyjob_t *jobs = calloc(copy_list->len ? copy_list->len : 1, sizeof(copyjob_t));
+    if(!jobs) {
+        fprintf(stderr, "pack_changes: Failed to allocate copy jobs\n");
         return -1;
     }
 
-    // Ensure parent directory of dst exists
-    char dst_parent[PATH_MAX];
-    snprintf(dst_parent, sizeof(dst_parent), "%s", dst);
-    
-    char *last_sep = strrchr(dst_parent, '/');
-#ifdef _WIN32
-    char *last_backslash = strrchr(dst_parent, '\\');
-    if (last_backslash && (!last_sep || last_backslash > last_sep)) {
-        last_sep = last_backslash;
-    }
-#endif
-    
-    if (last_sep) {
-        *last_sep = '\0';
-        ensure_directory_exists(dst_parent);
-    }
+    journal_t journal;
+    journal_t *journaled = journal_open(&journal, copy_to_dir, opts->checkpoint) == 0 ? &journal : NULL;
 
-    FILE *out = fopen(dst, "wb");
-    if (!out) {
-        fprintf(stderr, "copy_file: Failed to create destination file: %s\n", dst);
-        fclose(in);
+    pack_t pack;
+    if(pack_open(&pack, copy_to_dir, journaled) != 0) {
+        if(journaled) journal_close(journaled);
+        free(jobs);
         return -1;
     }
 
-    char buf[8192];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
-        if (fwrite(buf, 1, n, out) != n) {
-            fprintf(stderr, "copy_file: Failed to write to destination file: %s\n", dst);
-            fclose(in); 
-            fclose(out);
-            return -1;
+    arena_t paths;
+    arena_init(&paths);
+
+    copystats_t stats = { 0 };
+    size_t failed = 0, count = 0;
+    for(size_t i = 0; i < copy_list->len; i++) {
+        const filediff_t *diff = &copy_list->items[i];
+
+        // Archive member names always use '/'
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s", make_relative_path(diff->filename, opts->directory));
+        for(char *p = name; *p; p++) {
+            if(*p == PATH_SEP) *p = '/';
+        }
+
+        int status = pack_add(&pack, diff->filename, name, &stats);
+        if(status == PACK_TOO_LARGE) {
+            char dst_path[PATH_MAX];
+            snprintf(dst_path, sizeof(dst_path), "%s%c%s", copy_to_dir, PATH_SEP, make_relative_path(diff->filename, opts->directory));
+
+            copyjob_t *job = &jobs[count];
+            job->src = diff->filename;
+            job->dst = arena_strdup(&paths, dst_path);
+            job->size = diff->file_size;
+            if(job->dst) count++;
+            else failed++;
+        } else if(status != 0) {
+            fprintf(stderr, "Failed to pack %s\n", diff->filename);
+            failed++;
+        } else {
+            fprintf(info, "Packed: %s\n", name);
         }
     }
 
-    fclose(in);
-    fclose(out);
-    return 0;
-}
+    int volumes = pack_close(&pack);
+    if(volumes < 0) failed++;
 
-const char *make_relative_path(const char *full_path, const char *base_path) 
-{
-    size_t base_len = strlen(base_path);
-    
-    // Ensure base_path ends with separator for proper comparison
-    char normalized_base[PATH_MAX];
-    snprintf(normalized_base, sizeof(normalized_base), "%s", base_path);
-    
-    // Add trailing separator if not present
-    if (base_len > 0 && normalized_base[base_len-1] != '/' && normalized_base[base_len-1] != '\\') {
-#ifdef _WIN32
-        strncat(normalized_base, "\\", PATH_MAX - base_len - 1);
-#else
-        strncat(normalized_base, "/", PATH_MAX - base_len - 1);
-#endif
-        base_len++;
-    }
-    
-#ifdef _WIN32
-    // Case-insensitive match on Windows
-    if (_strnicmp(full_path, normalized_base, base_len) == 0) {
-#else
-    if (strncmp(full_path, normalized_base, base_len) == 0) {
-#endif
-        return full_path + base_len;
+    // A file that does not fit in a volume would not fit on FAT32 in one either
+    copystats_t copied = { 0 };
+    if(count) {
+        if(journaled) {
+            for(size_t i = 0; i < count; i++) journal_plan(journaled, jobs[i].dst);
+            journal_begin(journaled);
+        }
+        failed += copy_files(jobs, count, opts->jobs, opts->dirs, journaled, &copied);
+
+        for(size_t i = 0; i < count; i++) {
+            if(jobs[i].status != 0) fprintf(stderr, "Failed to copy %s to %s\n", jobs[i].src, jobs[i].dst);
+            else fprintf(info, "Copied: %s -> %s (too large to pack)\n", make_relative_path(jobs[i].src, opts->directory), jobs[i].dst);
+        }
     }
-    
-    // If no match, try without the trailing separator
-    base_len = strlen(base_path);
-#ifdef _WIN32
-    if (_strnicmp(full_path, base_path, base_len) == 0) {
-#else
-    if (strncmp(full_path, base_path, base_len) == 0) {
-#endif
-        const char *rel = full_path + base_len;
-        if (*rel == '\\' || *rel == '/') rel++;
-        return rel;
+
+    if(journaled && journal_close(journaled) != 0) {
+        fprintf(stderr, "Failed to sync %s, the archive may not be on disk yet\n", copy_to_dir);
+        failed++;
     }
-    
-    return full_path; // fallback
+
+    fprintf(info, "Packed %zu files (%lld bytes) into %d volume%s %s/%s*.tar\n", stats.files,
+            stats.bytes_copied, volumes > 0 ? volumes : 0, volumes == 1 ? "" : "s", copy_to_dir, pack.stem);
+    if(count) copystats_print(&copied, info);
+
+    arena_free(&paths);
+    free(jobs);
+    return failed ? -1 : 0;
 }
 
 int main(int argc, char **argv)
 {   
     char *copy_to_dir = NULL;
     char *directory = NULL;
+    char *compare_old = NULL;
+    char *compare_new = NULL;
+    int summary_depth = -1;
+    char *dupes_snapshot = NULL;
+    dupes_mode_t dupes_mode = DUPES_REPORT;
+    output_format_t format = FORMAT_TEXT;
+    int copy_jobs = COPY_DEFAULT_JOBS;
+    int read_once = 0;
+    int delta = 0;
+    int pack = 0;
+    int compress = 0;
+    char *store_dir = NULL;
+    int mirror = 0;
+    char *unpack_archive = NULL;
+    char *unpack_dir = NULL;
+    size_t checkpoint = 0;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--copy-to") == 0 && i + 1 < argc) {
             copy_to_dir = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            copy_jobs = atoi(argv[++i]);
+            if (copy_jobs < 1) {
+                fprintf(stderr, "--jobs expects a positive number of copies\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--delta") == 0) {
+            delta = 1;
+        } else if (strcmp(argv[i], "--read-once") == 0) {
+            read_once = 1;
+        } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            compress = atoi(argv[++i]);
+            if (compress < 1 || compress > 9) {
+                fprintf(stderr, "Compression level must be between 1 and 9\n");
+                return 1;
+            }
+            if (!COMPRESS_SUPPORTED) {
+                fprintf(stderr, "usbdiff was built without compression, rebuild with make ZLIB=1\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            store_dir = argv[++i];
+        } else if (strcmp(argv[i], "--mirror") == 0) {
+            mirror = 1;
+        } else if (strcmp(argv[i], "--pack") == 0) {
+            pack = 1;
+        } else if (strcmp(argv[i], "--unpack") == 0 && i + 2 < argc) {
+            unpack_archive = argv[++i];
+            unpack_dir = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+            compare_old = argv[++i];
+            compare_new = argv[++i];
+        } else if (strcmp(argv[i], "--dupes") == 0 && i + 1 < argc) {
+            dupes_snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--link") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hard") == 0) dupes_mode = DUPES_HARDLINK;
+            else if (strcmp(argv[i], "reflink") == 0) dupes_mode = DUPES_REFLINK;
+            else {
+                fprintf(stderr, "Unknown link type %s, expected hard or reflink\n", argv[i]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            if (output_parse_format(argv[i] + 9, &format) != 0) {
+                fprintf(stderr, "Unknown format %s, expected text, ndjson or null\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--summary") == 0 && i + 1 < argc) {
+            summary_depth = atoi(argv[++i]);
         } else if (argv[i][0] != '-') {
             directory = argv[i];
         }
     }
 
+    // The summary is a table for people, it would only corrupt output meant for programs
+    if (summary_depth >= 0 && format != FORMAT_TEXT) {
+        fprintf(stderr, "--summary can only be used with --format=text\n");
+        return 1;
+    }
+
+    if (dupes_snapshot) {
+        findex_t idx;
+        if (load_snapshot(&idx, dupes_snapshot) != 0) {
+            fprintf(stderr, "Failed to load snapshot %s\n", dupes_snapshot);
+            return 1;
+        }
+
+        int status = find_dupes(&idx, dupes_mode);
+        findex_free(&idx);
+        return status ? 1 : 0;
+    }
+
+    if (compare_old) {
+        return compare_snapshots(compare_old, compare_new, summary_depth, format);
+    }
+
+    if (unpack_archive) {
+        return unpack(unpack_archive, unpack_dir, stdout) != 0 ? 1 : 0;
+    }
+
     if (!directory) {
-        printf("Usage: ./usbdiff [--copy-to <dir>] <directory>\n");
+        printf("Usage: ./usbdiff [--format=text|ndjson|null] [--copy-to <dir> [--jobs <n>] [--read-once] [--delta] [--compress <level>] [--mirror] [--pack] [--checkpoint <files>]] [--store <dir>] [--summary <depth>] <directory>\n");
+        printf("       ./usbdiff [--format=text|ndjson|null] [--summary <depth>] --compare <old snapshot> <new snapshot>\n");
+        printf("       ./usbdiff [--link hard|reflink] --dupes <snapshot>\n");
+        printf("       ./usbdiff --unpack <archive> <directory>\n");
         return 1;
     }
 
+    FILE *info = format == FORMAT_TEXT ? stdout : stderr;
+
     // If JSON doesn't exist, create one
-    FILE *fp = fopen(".usbdiff.json", "r");
+    FILE *fp = fopen(SNAPSHOT_FILE, "r");
     if(!fp) {
-        FILE *new_fp = fopen(".usbdiff.json", "w");
+        FILE *new_fp = fopen(SNAPSHOT_FILE, "w");
         if(!new_fp) {
-            fprintf(stderr, "Failed to create .usbdiff.json\n");
+            fprintf(stderr, "Failed to create " SNAPSHOT_FILE "\n");
             return -1;
         } else fclose(new_fp);
 
     }   else fclose(fp);
     
-    fhashmap_t prev_fhashmap;
+    findex_t prev_index;
     fhashmap_t curr_fhashmap;
 
-    fhashmap_init(&prev_fhashmap);
-    fhashmap_init(&curr_fhashmap);
+    if(load_snapshot(&prev_index, SNAPSHOT_FILE) != 0) {
+        fprintf(stderr, "Failed to index previous snapshot\n");
+        return 1;
+    }
 
-    parse_json_stream(&prev_fhashmap, ".usbdiff.json");
+    fhashmap_init(&curr_fhashmap);
 
     filelist_t list;
     list.len = 0;
@@ -434,9 +1079,22 @@ int main(int argc, char **argv)
     list_print(&list);
     #endif
 
-    load_files(&list, &curr_fhashmap, &prev_fhashmap);
+    // Clean up after an interrupted run before anything is written to the destination, the
+    // read-once copies below included
+    journal_resume_t resume = { 0 };
+    if(copy_to_dir) journal_recover(copy_to_dir, &resume, 0, info);
 
-    printf("Scanned %i files\n", list.len);
+    // Back up changed files in the same pass that hashes them. Delta copies have to go
+    // through the block maps, so they are left to the copy stage.
+    dircache_t dirs;
+    if(copy_to_dir) dircache_init(&dirs, copy_to_dir);
+
+    readonce_t readonce = { directory, copy_to_dir, &dirs, NULL, 0, 0, { 0 } };
+    readonce_t *fused = copy_to_dir && read_once && !pack && !compress && !delta ? &readonce : NULL;
+
+    load_files(&list, &curr_fhashmap, &prev_index, fused);
+
+    fprintf(info, "Scanned %zu files\n", list.len);
 
     #if DEBUG
     printf("Current Hashmap: \n");
@@ -444,75 +1102,114 @@ int main(int argc, char **argv)
     printf("-----------------------------------\n");
     #endif
 
-    #if DEBUG
-    printf("Previous Hashmap: \n");
-    fhashmap_print(&prev_fhashmap);
-    printf("-----------------------------------\n");
-    #endif
+    // Freeze the current snapshot into path order as well, so the diff is one merge pass
+    findex_t curr_index;
+    if(findex_build(&curr_index, &curr_fhashmap) != 0) {
+        fprintf(stderr, "Failed to index current snapshot\n");
+        findex_free(&prev_index);
+        fhashmap_free(&curr_fhashmap);
+        return 1;
+    }
+
+    // Compare prev and curr snapshots
+    difflist_t copy_list;
+    difflist_init(&copy_list);
 
-    // Compare prev and curr hashmaps
-    filediff_t *diffs = malloc(sizeof(filediff_t)*MAX_DIFFS);
-    if(!diffs)  {
-        fprintf(stderr, "Failed to allocate memory for diffs\n");
-        fhashmap_free(&prev_fhashmap);
+    renames_t renames;
+    if(find_renames(&renames, &curr_index, &prev_index) != 0) {
+        fprintf(stderr, "Failed to detect renamed files\n");
+        findex_free(&prev_index);
+        findex_free(&curr_index);
         fhashmap_free(&curr_fhashmap);
         return 1;
     }
 
-    size_t diff_count = map_diff(diffs, &curr_fhashmap, &prev_fhashmap);
-    if(diff_count == 0)  {
-        free(diffs);
-        fhashmap_free(&prev_fhashmap);
+    summary_t summary;
+    if(summary_depth >= 0 && summary_init(&summary, directory, summary_depth) != 0) {
+        renames_free(&renames);
+        findex_free(&prev_index);
+        findex_free(&curr_index);
         fhashmap_free(&curr_fhashmap);
-        return 0;
+        return 1;
+    }
+
+    output_t output;
+    if(output_init(&output, stdout, format) != 0) {
+        if(summary_depth >= 0) summary_free(&summary);
+        renames_free(&renames);
+        findex_free(&prev_index);
+        findex_free(&curr_index);
+        fhashmap_free(&curr_fhashmap);
+        return 1;
     }
 
-    print_diff(diffs, diff_count);
+    diffrun_t run = { 0, copy_to_dir ? &copy_list : NULL, mirror && !pack, summary_depth >= 0 ? &summary : NULL, &output };
+    map_diff(&curr_index, &prev_index, &renames, on_diff, &run);
+    renames_free(&renames);
+    output_free(&output);
 
-    if(copy_to_dir) {
-        printf("\nCopying modified files to: %s\n", copy_to_dir);
-        
-        for(size_t i = 0; i < diff_count; i++) {
-            if(diffs[i].status != MODIFIED) continue;
+    if(run.summary) {
+        if(run.count) summary_print(run.summary, stdout);
+        summary_free(run.summary);
+    }
 
-            const char *rel_path = make_relative_path(diffs[i].filename, directory);
+    // The store takes the whole tree, changed or not
+    int backup_failed = 0;
+    if(store_dir) {
+        fprintf(info, "\nStoring %s in: %s\n", directory, store_dir);
+        if(store_snapshot(&curr_index, &curr_fhashmap, store_dir, copy_jobs, checkpoint, info) != 0) backup_failed = 1;
+    }
 
-            char dst_path[PATH_MAX];
-            snprintf(dst_path, sizeof(dst_path), "%s%c%s", copy_to_dir, 
-#ifdef _WIN32
-                     '\\',
-#else
-                     '/',
-#endif
-                     rel_path);
+    if(run.count == 0)  {
+        fprintf(info, "No changes to directory.\n");
+        if(copy_to_dir) dircache_free(&dirs);
+        journal_resume_free(&resume);
+        findex_free(&prev_index);
+        findex_free(&curr_index);
+        fhashmap_free(&curr_fhashmap);
+        return backup_failed;
+    }
 
-            if(copy_file(diffs[i].filename, dst_path) != 0)   {
-                fprintf(stderr, "Failed to copy %s to %s\n", diffs[i].filename, dst_path);
-            }
-            else {
-                printf("Copied: %s -> %s\n", rel_path, dst_path);
-            }
-        }
+    if(copy_to_dir) {
+        fprintf(info, "\nCopying modified files to: %s\n", copy_to_dir);
+        // compress_file splits large files across threads of its own inside the copy pool
+        if(compress) omp_set_max_active_levels(2);
+
+        copyopts_t opts = { directory, copy_to_dir, copy_jobs, delta, compress, mirror, &dirs, checkpoint, fused, &resume, &curr_index, info };
+        int status = pack ? pack_changes(&copy_list, &opts) : copy_changes(&copy_list, &opts);
+        if(status != 0) backup_failed = 1;
     }
 
-    free(diffs);
+    difflist_free(&copy_list);
+    free(readonce.copied);
+    journal_resume_free(&resume);
+    if(copy_to_dir) dircache_free(&dirs);
+    findex_free(&prev_index);
+
+    // Keep the old snapshot when the backup is incomplete, so the next run sees the same
+    // changes and copies whatever did not make it
+    if(backup_failed) {
+        fprintf(stderr, "Backup incomplete, " SNAPSHOT_FILE " was not updated\n");
+        findex_free(&curr_index);
+        fhashmap_free(&curr_fhashmap);
+        return 1;
+    }
 
     // Update JSON with changes made to directory 
     cJSON *files_object = create_json(&curr_fhashmap);
     if(!files_object)   {
         fprintf(stderr, "Failed to create cJSON object\n");
-        fhashmap_free(&prev_fhashmap);
+        findex_free(&curr_index);
         fhashmap_free(&curr_fhashmap);
         return 1;
     }
 
-    const char *outfile = ".usbdiff.json";
-    fp = fopen(outfile, "w");
+    fp = fopen(SNAPSHOT_FILE, "w");
 
     if(!fp) {
         fprintf(stderr, "Failed to write to JSON output file\n");
         cJSON_Delete(files_object);
-        fhashmap_free(&prev_fhashmap);
+        findex_free(&curr_index);
         fhashmap_free(&curr_fhashmap);
         return 1;
     }
@@ -521,7 +1218,13 @@ int main(int argc, char **argv)
     fclose(fp);
     
     cJSON_Delete(files_object);
-    fhashmap_free(&prev_fhashmap);
+
+    // Keep the frozen snapshot so the next run can map it instead of parsing the JSON
+    char index_path[PATH_MAX];
+    snapshot_index_path(index_path, sizeof(index_path), SNAPSHOT_FILE);
+    findex_write(&curr_index, index_path, SNAPSHOT_FILE);
+    findex_free(&curr_index);
+
     fhashmap_free(&curr_fhashmap);
 
     return 0;
@@ -11,20 +11,20 @@
 #include <unistd.h>
 #define MAX_PATH 1024
 #define PATH_SEP '/'
-#define FOREGROUND_RED   "\033[31m"
-#define FOREGROUND_GREEN "\033[32m"
-#define RESET_COLOR      "\033[0m"
 #define _strdup strdup
 #endif
 
-#define MAX_DIFFS 1024
 #define MAX_FILES 5192
 
 #define DEBUG 0
 
+#define SNAPSHOT_FILE ".usbdiff.json" // A frozen copy is kept next to it as .usbdiff.idx, see findex.h
+
 typedef struct {
-    char filename[MAX_PATH];
-    enum { MODIFIED, DELETED } status;
+    const char *filename;
+    const char *old_filename; // RENAMED only: where the content used to live
+    long long file_size;      // Current size, or the last known size of a DELETED file
+    enum { ADDED, MODIFIED, DELETED, RENAMED } status;
 } filediff_t;
 
 typedef struct  {